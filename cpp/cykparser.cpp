@@ -0,0 +1,2263 @@
+#include "cykparser.h"
+
+#include <set>
+#include <tuple>
+#include <memory>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+using namespace std;
+
+const std::string variable_pattern = variable_regex;
+
+grammar_type builtinGrammar()
+{
+    grammar_type rules;
+    for (const BuiltinRule &rule : builtin_rules)
+    {
+        if (rule.second != nullptr)
+            rules[rule.left_side].push_back({rule.first, rule.second});
+        else
+            rules[rule.left_side].push_back({rule.first});
+    }
+    return rules;
+}
+
+// Hand-written DFA over a whole token. Variables are letters in
+// hyphen-separated groups that do not start with "lambda", the same
+// language as variable_pattern
+TokenKind classifyToken(const std::string &token)
+{
+    static const char keyword[] = "lambda";
+    const std::size_t keyword_size = sizeof(keyword) - 1;
+
+    if (token.size() == 1 && token[0] == '(')
+        return TokenKind::LPAREN;
+    if (token.size() == 1 && token[0] == ')')
+        return TokenKind::RPAREN;
+
+    // Length of the keyword prefix matched so far, and whether the next
+    // character has to be a letter (at the start and after a hyphen)
+    std::size_t keyword_matched = 0;
+    bool expect_letter = true;
+    for (std::size_t i = 0; i < token.size(); i++)
+    {
+        char c = token[i];
+        if (isLetter(c))
+            expect_letter = false;
+        else if (c == '-' && !expect_letter)
+            expect_letter = true;
+        else
+            return TokenKind::INVALID;
+
+        if (keyword_matched == i && i < keyword_size && c == keyword[i])
+            keyword_matched++;
+    }
+
+    if (expect_letter)
+        return TokenKind::INVALID;
+    if (keyword_matched == keyword_size)
+        return token.size() == keyword_size ? TokenKind::LAMBDA : TokenKind::INVALID;
+    return TokenKind::VARIABLE;
+}
+
+// Resolves a terminal rule to the token kind it matches, if it matches
+// exactly the tokens of one kind
+bool terminalTokenKind(const std::string &pattern, TokenKind &kind)
+{
+    if (pattern == variable_pattern)
+    {
+        kind = TokenKind::VARIABLE;
+        return true;
+    }
+
+    // Parentheses and the keyword have a single spelling, so a literal
+    // pattern equal to it matches that kind and nothing else
+    kind = classifyToken(pattern);
+    return kind == TokenKind::LPAREN || kind == TokenKind::RPAREN || kind == TokenKind::LAMBDA;
+}
+
+TerminalMatcher compileTerminal(const TerminalRule &rule)
+{
+    TerminalMatcher matcher;
+    matcher.left_side = rule.left_side;
+    matcher.literal = rule.pattern;
+    try
+    {
+        matcher.regex = std::regex(rule.pattern);
+        matcher.is_regex = true;
+    }
+    catch (const std::regex_error &)
+    {
+        matcher.is_regex = false;
+    }
+    return matcher;
+}
+
+int internSymbol(CompiledGrammar &compiled, const std::string &symbol)
+{
+    auto it = compiled.symbol_ids.find(symbol);
+    if (it != compiled.symbol_ids.end())
+        return it->second;
+
+    int id = (int)compiled.symbols.size();
+    compiled.symbols.push_back(symbol);
+    compiled.symbol_ids[symbol] = id;
+    return id;
+}
+
+// Builds the tables derived from the rules: the binary index, the rules
+// and backpointer slot of each left side, and the terminal symbol sets
+void indexGrammar(CompiledGrammar &compiled)
+{
+    std::size_t symbol_count = compiled.symbols.size();
+    compiled.binary_index.assign(symbol_count * symbol_count, 0);
+    compiled.binary_rules_of.assign(symbol_count, std::vector<int>());
+    compiled.backpointer_slot.assign(symbol_count, -1);
+    compiled.backpointer_slots = 0;
+    compiled.first_symbols = 0;
+    compiled.second_symbols = 0;
+    for (std::size_t id = 0; id < compiled.binary_rules.size(); id++)
+    {
+        const BinaryRule &rule = compiled.binary_rules[id];
+        compiled.binary_index[rule.first * symbol_count + rule.second] |= symbolBit(rule.left_side);
+        compiled.binary_rules_of[rule.left_side].push_back((int)id);
+        if (compiled.backpointer_slot[rule.left_side] < 0)
+            compiled.backpointer_slot[rule.left_side] = compiled.backpointer_slots++;
+        compiled.first_symbols |= symbolBit(rule.first);
+        compiled.second_symbols |= symbolBit(rule.second);
+    }
+
+    std::fill(compiled.token_symbols, compiled.token_symbols + token_kind_count, 0);
+    compiled.terminal_matchers.clear();
+    for (const TerminalRule &rule : compiled.terminal_rules)
+    {
+        TokenKind kind;
+        if (terminalTokenKind(rule.pattern, kind))
+            compiled.token_symbols[(int)kind] |= symbolBit(rule.left_side);
+        else
+            compiled.terminal_matchers.push_back(compileTerminal(rule));
+    }
+}
+
+CompiledGrammar compileGrammar(const grammar_type &rules, const std::string &start_symbol)
+{
+    CompiledGrammar compiled;
+
+    // Left sides first, so the ids follow the order of the grammar map
+    for (const auto &rule : rules)
+        internSymbol(compiled, rule.first);
+
+    for (const auto &rule : rules)
+    {
+        int left_side = compiled.symbol_ids[rule.first];
+        for (const std::vector<std::string> &right_side : rule.second)
+        {
+            if (right_side.size() == 2)
+            {
+                int first = internSymbol(compiled, right_side[0]);
+                int second = internSymbol(compiled, right_side[1]);
+                compiled.binary_rules.push_back({left_side, first, second});
+            }
+            else if (right_side.size() == 1)
+            {
+                compiled.terminal_rules.push_back({left_side, right_side[0]});
+            }
+        }
+    }
+    compiled.start_symbol = internSymbol(compiled, start_symbol);
+
+    if (compiled.symbols.size() > (std::size_t)max_symbols)
+        throw std::length_error("grammar has more than " + std::to_string(max_symbols) + " symbols");
+
+    indexGrammar(compiled);
+    return compiled;
+}
+
+CompiledGrammar builtinCompiledGrammar()
+{
+    return compileGrammar(builtinGrammar(), "S");
+}
+
+bool isBuiltinGrammar(const CompiledGrammar &grammar)
+{
+    return serializeGrammar(grammar) == serializeGrammar(builtinCompiledGrammar());
+}
+
+#ifdef CYK_FIXED_GRAMMAR
+const int cyk_fixed_grammar_build = 1;
+#else
+const int cyk_dynamic_grammar_build = 1;
+#endif
+
+#ifdef CYK_FIXED_GRAMMAR
+bool fixedGrammarMatches(const CompiledGrammar &compiled)
+{
+    if (compiled.symbolCount() != fixedSymbolCount() || compiled.start_symbol != fixed_start_symbol ||
+        compiled.symbolId("F") != fixed_binder_symbol)
+        return false;
+
+    for (int first = 0; first < compiled.symbolCount(); first++)
+    {
+        for (int second = 0; second < compiled.symbolCount(); second++)
+        {
+            if (FixedCombine<0>::apply(symbolBit(first), symbolBit(second)) != compiled.producers(first)[second])
+                return false;
+        }
+    }
+    return true;
+}
+#endif
+
+// The compile-time tables stand in for the rule index of any grammar
+// given, so a fixed build refuses the grammars they do not match instead
+// of filling wrong charts with them
+void requireSupportedGrammar(const CompiledGrammar &grammar)
+{
+#ifdef CYK_FIXED_GRAMMAR
+    if (!fixedGrammarMatches(grammar))
+        throw std::invalid_argument("built with CYK_FIXED_GRAMMAR: only the built-in grammar can be used");
+#else
+    (void)grammar;
+#endif
+}
+
+// Replaces the XML character references and predefined entities
+std::string decodeXmlText(const std::string &text)
+{
+    std::string decoded;
+    for (std::size_t i = 0; i < text.size(); i++)
+    {
+        std::size_t end = text[i] == '&' ? text.find(';', i) : std::string::npos;
+        if (end == std::string::npos)
+        {
+            decoded += text[i];
+            continue;
+        }
+
+        std::string entity = text.substr(i + 1, end - i - 1);
+        if (entity == "amp")
+            decoded += '&';
+        else if (entity == "lt")
+            decoded += '<';
+        else if (entity == "gt")
+            decoded += '>';
+        else if (entity == "quot")
+            decoded += '"';
+        else if (entity == "apos")
+            decoded += '\'';
+        else if (entity.size() > 1 && entity[0] == '#')
+            decoded += (char)std::strtol(entity.c_str() + (entity[1] == 'x' ? 2 : 1), nullptr, entity[1] == 'x' ? 16 : 10);
+        else
+            throw std::runtime_error("unknown XML entity &" + entity + ";");
+        i = end;
+    }
+
+    std::size_t first = decoded.find_first_not_of(" \t\r\n");
+    std::size_t last = decoded.find_last_not_of(" \t\r\n");
+    return first == std::string::npos ? std::string() : decoded.substr(first, last - first + 1);
+}
+
+// Text of the first <tag> element in xml[from, to), empty for <tag/>
+std::string xmlElementText(const std::string &xml, std::size_t from, std::size_t to, const std::string &tag)
+{
+    std::size_t open = xml.find("<" + tag, from);
+    if (open == std::string::npos || open >= to)
+        throw std::runtime_error("production without <" + tag + ">");
+
+    std::size_t content = xml.find('>', open);
+    if (content == std::string::npos || content >= to)
+        throw std::runtime_error("unterminated <" + tag + ">");
+    if (xml[content - 1] == '/')
+        return std::string();
+
+    std::size_t close = xml.find("</" + tag + ">", content);
+    if (close == std::string::npos || close >= to)
+        throw std::runtime_error("unterminated <" + tag + ">");
+    return decodeXmlText(xml.substr(content + 1, close - content - 1));
+}
+
+inline bool isGrammarVariable(char c)
+{
+    return c >= 'A' && c <= 'Z';
+}
+
+// Right side of a JFLAP production in the form of the grammar map. JFLAP
+// variables are single capital letters; the terminal "variable" stands
+// for any variable name and brackets for parentheses, as in
+// normal_grammar.jff
+std::vector<std::string> jffRightSide(const std::string &left, const std::string &right)
+{
+    if (right.size() == 2 && isGrammarVariable(right[0]) && isGrammarVariable(right[1]))
+        return {right.substr(0, 1), right.substr(1, 1)};
+
+    if (right.empty() || std::any_of(right.begin(), right.end(), isGrammarVariable))
+        throw std::runtime_error("production " + left + " -> " + (right.empty() ? "(empty)" : right) +
+                                 " is not in Chomsky normal form");
+
+    if (right == "variable")
+        return {variable_pattern};
+    if (right == "[")
+        return {"("};
+    if (right == "]")
+        return {")"};
+    return {right};
+}
+
+grammar_type parseJffGrammar(const std::string &xml, std::string &start_symbol)
+{
+    grammar_type rules;
+    start_symbol.clear();
+
+    for (std::size_t from = xml.find("<production>"); from != std::string::npos; from = xml.find("<production>", from))
+    {
+        std::size_t to = xml.find("</production>", from);
+        if (to == std::string::npos)
+            throw std::runtime_error("unterminated <production>");
+
+        std::string left = xmlElementText(xml, from, to, "left");
+        std::string right = xmlElementText(xml, from, to, "right");
+        if (left.size() != 1 || !isGrammarVariable(left[0]))
+            throw std::runtime_error("left side " + left + " is not a single variable");
+
+        if (start_symbol.empty())
+            start_symbol = left;
+        rules[left].push_back(jffRightSide(left, right));
+        from = to;
+    }
+
+    if (rules.empty())
+        throw std::runtime_error("no productions");
+
+    for (const auto &rule : rules)
+    {
+        for (const std::vector<std::string> &right_side : rule.second)
+        {
+            for (const std::string &symbol : right_side)
+            {
+                if (right_side.size() == 2 && rules.find(symbol) == rules.end())
+                    throw std::runtime_error("variable " + symbol + " has no productions");
+            }
+        }
+    }
+    return rules;
+}
+
+// Compact binary form of a CompiledGrammar: a header, the symbol names,
+// the rules and the tables the parsers index, as native 32-bit words.
+// Only the regular expressions of the terminal matchers are rebuilt when
+// it is loaded
+const char grammar_magic[4] = {'C', 'Y', 'K', 'G'};
+
+const std::uint32_t grammar_format_version = 1;
+
+const std::uint32_t grammar_byte_order = 0x01020304;
+
+class GrammarWriter
+{
+public:
+    void word(std::uint32_t value)
+    {
+        bytes.append((const char *)&value, sizeof(value));
+    }
+
+    void text(const std::string &value)
+    {
+        word((std::uint32_t)value.size());
+        bytes += value;
+        bytes.append((4 - value.size() % 4) % 4, '\0');
+    }
+
+    std::string bytes;
+};
+
+class GrammarReader
+{
+public:
+    GrammarReader(const char *data, std::size_t size) : data(data), size(size), position(0) {}
+
+    std::uint32_t word()
+    {
+        std::uint32_t value;
+        std::memcpy(&value, take(sizeof(value)), sizeof(value));
+        return value;
+    }
+
+    // A symbol id, checked against the number of symbols
+    int symbol(std::uint32_t symbol_count)
+    {
+        std::uint32_t value = word();
+        if (value >= symbol_count)
+            throw std::runtime_error("symbol id out of range");
+        return (int)value;
+    }
+
+    std::string text()
+    {
+        std::uint32_t length = word();
+        std::string value(take(length), length);
+        take((4 - length % 4) % 4);
+        return value;
+    }
+
+    const char *take(std::size_t count)
+    {
+        if (count > size - position)
+            throw std::runtime_error("truncated compiled grammar");
+        const char *bytes = data + position;
+        position += count;
+        return bytes;
+    }
+
+private:
+    const char *data;
+    std::size_t size;
+    std::size_t position;
+};
+
+std::string serializeGrammar(const CompiledGrammar &compiled)
+{
+    GrammarWriter out;
+    out.bytes.append(grammar_magic, sizeof(grammar_magic));
+    out.word(grammar_format_version);
+    out.word(grammar_byte_order);
+    out.word((std::uint32_t)compiled.symbols.size());
+    out.word((std::uint32_t)compiled.binary_rules.size());
+    out.word((std::uint32_t)compiled.terminal_rules.size());
+    out.word((std::uint32_t)compiled.terminal_matchers.size());
+    out.word((std::uint32_t)compiled.start_symbol);
+    out.word((std::uint32_t)compiled.backpointer_slots);
+    out.word(compiled.first_symbols);
+    out.word(compiled.second_symbols);
+    for (int kind = 0; kind < token_kind_count; kind++)
+        out.word(compiled.token_symbols[kind]);
+
+    for (const std::string &symbol : compiled.symbols)
+        out.text(symbol);
+    for (const BinaryRule &rule : compiled.binary_rules)
+    {
+        out.word((std::uint32_t)rule.left_side);
+        out.word((std::uint32_t)rule.first);
+        out.word((std::uint32_t)rule.second);
+    }
+    for (const TerminalRule &rule : compiled.terminal_rules)
+    {
+        out.word((std::uint32_t)rule.left_side);
+        out.text(rule.pattern);
+    }
+    for (const TerminalMatcher &matcher : compiled.terminal_matchers)
+    {
+        out.word((std::uint32_t)matcher.left_side);
+        out.text(matcher.literal);
+    }
+    for (symbol_set producers : compiled.binary_index)
+        out.word(producers);
+    for (int slot : compiled.backpointer_slot)
+        out.word((std::uint32_t)slot);
+    return out.bytes;
+}
+
+bool isCompiledGrammar(const char *data, std::size_t size)
+{
+    return size >= sizeof(grammar_magic) && std::memcmp(data, grammar_magic, sizeof(grammar_magic)) == 0;
+}
+
+// Reads a grammar written by serializeGrammar. Only the symbols and rules
+// are taken from the file: the tables derived from them are rebuilt, and a
+// file whose stored tables differ from the rebuilt ones is rejected, since
+// the chart engines index memory with them unchecked
+CompiledGrammar deserializeGrammar(const char *data, std::size_t size)
+{
+    GrammarReader in(data, size);
+    if (!isCompiledGrammar(in.take(sizeof(grammar_magic)), sizeof(grammar_magic)) ||
+        in.word() != grammar_format_version || in.word() != grammar_byte_order)
+        throw std::runtime_error("not a compiled grammar of this version and byte order");
+
+    CompiledGrammar compiled;
+    std::uint32_t symbol_count = in.word();
+    std::uint32_t binary_rule_count = in.word();
+    std::uint32_t terminal_rule_count = in.word();
+    std::uint32_t matcher_count = in.word();
+    if (symbol_count == 0 || symbol_count > (std::uint32_t)max_symbols)
+        throw std::runtime_error("bad symbol count");
+    compiled.start_symbol = in.symbol(symbol_count);
+    std::uint32_t backpointer_slots = in.word();
+    symbol_set first_symbols = in.word();
+    symbol_set second_symbols = in.word();
+    symbol_set token_symbols[token_kind_count];
+    for (int kind = 0; kind < token_kind_count; kind++)
+        token_symbols[kind] = in.word();
+
+    for (std::uint32_t id = 0; id < symbol_count; id++)
+    {
+        compiled.symbols.push_back(in.text());
+        compiled.symbol_ids[compiled.symbols.back()] = (int)id;
+    }
+    if (compiled.symbol_ids.size() != symbol_count)
+        throw std::runtime_error("duplicate symbol name");
+
+    for (std::uint32_t id = 0; id < binary_rule_count; id++)
+    {
+        BinaryRule rule;
+        rule.left_side = in.symbol(symbol_count);
+        rule.first = in.symbol(symbol_count);
+        rule.second = in.symbol(symbol_count);
+        compiled.binary_rules.push_back(rule);
+    }
+    for (std::uint32_t id = 0; id < terminal_rule_count; id++)
+    {
+        TerminalRule rule;
+        rule.left_side = in.symbol(symbol_count);
+        rule.pattern = in.text();
+        compiled.terminal_rules.push_back(rule);
+    }
+    std::vector<TerminalRule> matchers;
+    for (std::uint32_t id = 0; id < matcher_count; id++)
+    {
+        TerminalRule rule;
+        rule.left_side = in.symbol(symbol_count);
+        rule.pattern = in.text();
+        matchers.push_back(rule);
+    }
+    std::vector<symbol_set> binary_index((std::size_t)symbol_count * symbol_count);
+    for (symbol_set &producers : binary_index)
+        producers = in.word();
+    std::vector<int> backpointer_slot(symbol_count);
+    for (int &slot : backpointer_slot)
+        slot = (int)in.word();
+
+    indexGrammar(compiled);
+
+    bool consistent = backpointer_slots == (std::uint32_t)compiled.backpointer_slots &&
+                      first_symbols == compiled.first_symbols && second_symbols == compiled.second_symbols &&
+                      std::equal(token_symbols, token_symbols + token_kind_count, compiled.token_symbols) &&
+                      binary_index == compiled.binary_index && backpointer_slot == compiled.backpointer_slot &&
+                      matchers.size() == compiled.terminal_matchers.size();
+    for (std::size_t id = 0; consistent && id < matchers.size(); id++)
+    {
+        const TerminalMatcher &matcher = compiled.terminal_matchers[id];
+        consistent = matchers[id].left_side == matcher.left_side && matchers[id].pattern == matcher.literal;
+    }
+    if (!consistent)
+        throw std::runtime_error("compiled grammar tables do not match its rules");
+    return compiled;
+}
+
+MappedFile::~MappedFile()
+{
+    if (data != nullptr && size != 0)
+        munmap((void *)data, size);
+}
+
+bool MappedFile::open(const std::string &path)
+{
+    int descriptor = ::open(path.c_str(), O_RDONLY);
+    if (descriptor < 0)
+        return false;
+
+    struct stat status;
+    bool ok = fstat(descriptor, &status) == 0;
+    if (ok && status.st_size > 0)
+    {
+        void *mapping = mmap(nullptr, (std::size_t)status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        ok = mapping != MAP_FAILED;
+        if (ok)
+        {
+            data = (const char *)mapping;
+            size = (std::size_t)status.st_size;
+        }
+    }
+    ::close(descriptor);
+    return ok;
+}
+
+CompiledGrammar loadGrammar(const std::string &path)
+{
+    MappedFile file;
+    if (!file.open(path))
+        throw std::runtime_error("cannot read the file");
+
+    CompiledGrammar grammar;
+    if (isCompiledGrammar(file.data, file.size))
+    {
+        grammar = deserializeGrammar(file.data, file.size);
+    }
+    else
+    {
+        std::string start_symbol;
+        grammar_type rules = parseJffGrammar(std::string(file.data, file.size), start_symbol);
+        grammar = compileGrammar(rules, start_symbol);
+    }
+    requireSupportedGrammar(grammar);
+    return grammar;
+}
+
+// Single-pass lexer over one input line. It yields parentheses, the
+// lambda keyword and variables with at most one hyphenated group, and
+// silently skips every other character, as the regex split used to
+class Lexer
+{
+public:
+    explicit Lexer(TextView line, std::size_t position = 0) : line(line), position(position) {}
+
+    bool next(Token &token)
+    {
+        static const char keyword[] = "lambda";
+        const std::size_t keyword_size = sizeof(keyword) - 1;
+
+        const char *text = line.data;
+        std::size_t size = line.size;
+        while (position < size)
+        {
+            std::size_t start = position;
+            char c = text[position];
+            if (c == '(' || c == ')')
+            {
+                position++;
+                return emit(token, start, c == '(' ? TokenKind::LPAREN : TokenKind::RPAREN);
+            }
+            if (size - position >= keyword_size && std::equal(keyword, keyword + keyword_size, text + position))
+            {
+                position += keyword_size;
+                return emit(token, start, TokenKind::LAMBDA);
+            }
+            if (isLetter(c))
+            {
+                while (position < size && isLetter(text[position]))
+                    position++;
+                if (position + 1 < size && text[position] == '-' && isLetter(text[position + 1]))
+                {
+                    position++;
+                    while (position < size && isLetter(text[position]))
+                        position++;
+                }
+                return emit(token, start, TokenKind::VARIABLE);
+            }
+            position++;
+        }
+        return false;
+    }
+
+private:
+    bool emit(Token &token, std::size_t start, TokenKind kind)
+    {
+        token.offset = (std::uint32_t)start;
+        token.length = (std::uint32_t)(position - start);
+        token.kind = kind;
+        return true;
+    }
+
+    TextView line;
+    std::size_t position;
+};
+
+void tokenize(TextView line, std::vector<Token> &tokens)
+{
+    tokens.clear();
+    Lexer lexer(line);
+    Token token;
+    while (lexer.next(token))
+        tokens.push_back(token);
+}
+
+#ifndef CYK_NO_STATS
+thread_local ParseStats *active_stats = nullptr;
+#endif
+
+// Records the split point k and the rule for each symbol in added, the
+// symbols first derived for the cell (i, j) from the cells left and right
+void recordBackpointers(const CompiledGrammar &grammar, cyk_table &table, int i, int j, int k, symbol_set added,
+                        symbol_set left, symbol_set right)
+{
+    for (; added != 0; added &= added - 1)
+    {
+        int symbol = lowestSymbol(added);
+        for (int rule : grammar.binary_rules_of[symbol])
+        {
+            const BinaryRule &binary_rule = grammar.binary_rules[rule];
+            if ((left & symbolBit(binary_rule.first)) && (right & symbolBit(binary_rule.second)))
+            {
+                Backpointer &backpointer = table.backpointer(i, j, grammar.backpointer_slot[symbol]);
+                backpointer.split = k;
+                backpointer.rule = rule;
+                break;
+            }
+        }
+    }
+}
+
+// Counters of one worker filling a chart
+struct ChartCounters
+{
+    long long rule_applications;
+    long long chart_entries;
+};
+
+// Calls fill(i, j, counters) for every cell (i, j) with i < j of a chart
+// of length tokens, after the cells it depends on. Short inputs are
+// filled column by column on the calling thread. Long ones are filled one
+// diagonal at a time, since the cells of a diagonal only read shorter
+// spans, with the cells of each diagonal spread over the pool of the
+// config. Returns
+// the sum of the counters of every worker
+template <typename Fill>
+ChartCounters fillSpans(const ChartConfig &config, int length, Fill fill)
+{
+    ChartCounters total = {0, 0};
+    WorkerPool *pool = config.pool;
+    if (pool == nullptr || pool->size() == 1 || length < config.parallel_threshold)
+    {
+        for (int j = 1; j < length; j++)
+        {
+            for (int i = j - 1; i >= 0; i--)
+                fill(i, j, total);
+        }
+        return total;
+    }
+
+    std::vector<ChartCounters> counters(pool->size(), total);
+    for (int span = 1; span < length; span++)
+    {
+        pool->parallelFor(length - span, 16, [&](std::size_t i, int worker) {
+            fill((int)i, (int)i + span, counters[worker]);
+        });
+    }
+    for (const ChartCounters &worker_counters : counters)
+    {
+        total.rule_applications += worker_counters.rule_applications;
+        total.chart_entries += worker_counters.chart_entries;
+    }
+    return total;
+}
+
+int nextSplitScalar(const symbol_set *left, const symbol_set *right, int from, int count, symbol_set firsts,
+                    symbol_set seconds)
+{
+    for (int k = from; k < count; k++)
+    {
+        if ((left[k] & firsts) && (right[k] & seconds))
+            return k;
+    }
+    return count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) int nextSplitSse2(const symbol_set *left, const symbol_set *right, int from,
+                                                  int count, symbol_set firsts, symbol_set seconds)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i first_mask = _mm_set1_epi32((int)firsts);
+    const __m128i second_mask = _mm_set1_epi32((int)seconds);
+    int k = from;
+    for (; k + 4 <= count; k += 4)
+    {
+        __m128i lefts = _mm_loadu_si128((const __m128i *)(left + k));
+        __m128i rights = _mm_loadu_si128((const __m128i *)(right + k));
+        // Lanes where either side has nothing to combine
+        __m128i empty = _mm_or_si128(_mm_cmpeq_epi32(_mm_and_si128(lefts, first_mask), zero),
+                                     _mm_cmpeq_epi32(_mm_and_si128(rights, second_mask), zero));
+        int found = ~_mm_movemask_ps(_mm_castsi128_ps(empty)) & 0xf;
+        if (found != 0)
+            return k + __builtin_ctz(found);
+    }
+    return nextSplitScalar(left, right, k, count, firsts, seconds);
+}
+
+__attribute__((target("avx2"))) int nextSplitAvx2(const symbol_set *left, const symbol_set *right, int from,
+                                                  int count, symbol_set firsts, symbol_set seconds)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i first_mask = _mm256_set1_epi32((int)firsts);
+    const __m256i second_mask = _mm256_set1_epi32((int)seconds);
+    int k = from;
+    for (; k + 8 <= count; k += 8)
+    {
+        __m256i lefts = _mm256_loadu_si256((const __m256i *)(left + k));
+        __m256i rights = _mm256_loadu_si256((const __m256i *)(right + k));
+        __m256i empty = _mm256_or_si256(_mm256_cmpeq_epi32(_mm256_and_si256(lefts, first_mask), zero),
+                                        _mm256_cmpeq_epi32(_mm256_and_si256(rights, second_mask), zero));
+        int found = ~_mm256_movemask_ps(_mm256_castsi256_ps(empty)) & 0xff;
+        if (found != 0)
+            return k + __builtin_ctz(found);
+    }
+    return nextSplitScalar(left, right, k, count, firsts, seconds);
+}
+#endif
+
+bool findSplitKernel(const std::string &name, SplitKernel &kernel)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (name == "avx2" || (name == "auto" && __builtin_cpu_supports("avx2")))
+    {
+        kernel = nextSplitAvx2;
+        return __builtin_cpu_supports("avx2");
+    }
+    if (name == "sse2" || (name == "auto" && __builtin_cpu_supports("sse2")))
+    {
+        kernel = nextSplitSse2;
+        return __builtin_cpu_supports("sse2");
+    }
+#endif
+    kernel = nextSplitScalar;
+    return name == "auto" || name == "scalar";
+}
+
+const char *splitKernelName(SplitKernel kernel)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (kernel == nextSplitAvx2)
+        return "avx2";
+    if (kernel == nextSplitSse2)
+        return "sse2";
+#endif
+    return "scalar";
+}
+
+SplitKernel selectSplitKernel()
+{
+    SplitKernel kernel;
+    findSplitKernel("auto", kernel);
+    return kernel;
+}
+
+// Fills the cell (i, j) of a CYK chart from lefts, the cells (i, i) ..
+// (i, j - 1), and rights, the cells (i + 1, j) .. (j, j), and returns it
+inline symbol_set fillCell(const CompiledGrammar &grammar, cyk_table &table, int i, int j, const symbol_set *lefts,
+                           const symbol_set *rights, bool record_backpointers, SplitKernel kernel,
+                           ChartCounters &counters)
+{
+    symbol_set cell = 0;
+
+    // Iterate over the split points k = i .. j - 1 where both (i, k) and
+    // (k + 1, j) have a symbol some rule can combine
+    int count = j - i;
+    for (int split = kernel(lefts, rights, 0, count, grammar.first_symbols, grammar.second_symbols);
+         split < count;
+         split = kernel(lefts, rights, split + 1, count, grammar.first_symbols, grammar.second_symbols))
+    {
+        symbol_set left = lefts[split];
+        symbol_set right = rights[split];
+        symbol_set produced = grammar.combine(left, right);
+        counters.rule_applications++;
+
+        if (record_backpointers && (produced & ~cell) != 0)
+            recordBackpointers(grammar, table, i, j, i + split, produced & ~cell, left, right);
+        cell |= produced;
+    }
+
+    table.at(i, j) = cell;
+    counters.chart_entries += __builtin_popcount(cell);
+    return cell;
+}
+
+bool cykParse(const CompiledGrammar &grammar, TextView line, const std::vector<Token> &input_str,
+              cyk_table &solution_table, ChartScratch &scratch, const ChartConfig &config, bool record_backpointers)
+{
+    int input_str_size = (int)input_str.size();
+
+    // Initialize the table
+    solution_table.reset(input_str_size, record_backpointers ? grammar.backpointer_slots : 0);
+
+    if (input_str_size == 0)
+        return false;
+
+    // rows[row_start[i] + k - i] is the cell (i, k)
+    std::vector<std::size_t> &row_start = scratch.row_start;
+    row_start.resize(input_str_size);
+    row_start[0] = 0;
+    for (int i = 1; i < input_str_size; i++)
+        row_start[i] = row_start[i - 1] + (input_str_size - i + 1);
+    std::vector<symbol_set> &rows = scratch.rows;
+    rows.resize(row_start[input_str_size - 1] + 1);
+
+    // Symbols deriving each token through a terminal rule
+    long long leaf_entries = 0;
+    for (int j = 0; j < input_str_size; j++)
+    {
+        symbol_set leaf = grammar.terminalSymbols(input_str[j].kind, tokenText(line, input_str[j]));
+        solution_table.at(j, j) = leaf;
+        rows[row_start[j]] = leaf;
+        leaf_entries += __builtin_popcount(leaf);
+    }
+
+    // Filling in the table
+    ChartCounters counters = fillSpans(config, input_str_size, [&](int i, int j, ChartCounters &counters) {
+        rows[row_start[i] + j - i] = fillCell(grammar, solution_table, i, j, &rows[row_start[i]],
+                                              solution_table.column(j) + i + 1, record_backpointers, config.kernel,
+                                              counters);
+    });
+
+    STATS_ADD(chart_cells, (long long)input_str_size * (input_str_size + 1) / 2);
+    STATS_ADD(rule_applications, counters.rule_applications);
+    STATS_ADD(chart_entries, leaf_entries + counters.chart_entries);
+
+    // If word can be formed from the start symbol
+    // of given grammar
+    return (solution_table.at(0, input_str_size - 1) & symbolBit(grammar.start_symbol)) != 0;
+}
+
+bool matrixParse(const CompiledGrammar &grammar, TextView line, const std::vector<Token> &input_str,
+                 cyk_table &solution_table, ChartScratch &scratch, const ChartConfig &config,
+                 bool record_backpointers)
+{
+    int input_str_size = (int)input_str.size();
+
+    solution_table.reset(input_str_size, record_backpointers ? grammar.backpointer_slots : 0);
+
+    if (input_str_size == 0)
+        return false;
+
+    BitMatrixChart &matrices = scratch.matrices;
+    matrices.reset(grammar, input_str_size);
+
+    // Symbols that can derive a span of two tokens or more
+    symbol_set binary_symbols = 0;
+    for (const BinaryRule &rule : grammar.binary_rules)
+        binary_symbols |= symbolBit(rule.left_side);
+
+    long long leaf_entries = 0;
+    for (int j = 0; j < input_str_size; j++)
+    {
+        symbol_set leaf = grammar.terminalSymbols(input_str[j].kind, tokenText(line, input_str[j]));
+        solution_table.at(j, j) = leaf;
+        matrices.add(j, j, leaf);
+        leaf_entries += __builtin_popcount(leaf);
+    }
+
+    // Filling (i, j) only writes the rows at i and the columns at j, so
+    // the cells of a diagonal can be filled in parallel
+    ChartCounters counters = fillSpans(config, input_str_size, [&](int i, int j, ChartCounters &counters) {
+        symbol_set cell = 0;
+
+        for (symbol_set symbols = binary_symbols; symbols != 0; symbols &= symbols - 1)
+        {
+            int symbol = lowestSymbol(symbols);
+            // cykParse keeps the first rule deriving the symbol at the
+            // lowest split point, so the same one is kept here
+            int best_split = -1;
+            int best_rule = -1;
+            for (int rule : grammar.binary_rules_of[symbol])
+            {
+                const BinaryRule &binary_rule = grammar.binary_rules[rule];
+                int split = matrices.lowestSplit(binary_rule.first, binary_rule.second, i, j);
+                counters.rule_applications++;
+                if (split >= 0 && (best_split < 0 || split < best_split))
+                {
+                    best_split = split;
+                    best_rule = rule;
+                }
+                if (best_split >= 0 && !record_backpointers)
+                    break;
+            }
+
+            if (best_split < 0)
+                continue;
+            cell |= symbolBit(symbol);
+            if (record_backpointers)
+            {
+                Backpointer &backpointer = solution_table.backpointer(i, j, grammar.backpointer_slot[symbol]);
+                backpointer.split = best_split;
+                backpointer.rule = best_rule;
+            }
+        }
+
+        solution_table.at(i, j) = cell;
+        matrices.add(i, j, cell);
+        counters.chart_entries += __builtin_popcount(cell);
+    });
+
+    STATS_ADD(chart_cells, (long long)input_str_size * (input_str_size + 1) / 2);
+    STATS_ADD(rule_applications, counters.rule_applications);
+    STATS_ADD(chart_entries, leaf_entries + counters.chart_entries);
+
+    return (solution_table.at(0, input_str_size - 1) & symbolBit(grammar.start_symbol)) != 0;
+}
+
+bool sameChart(const CompiledGrammar &grammar, const cyk_table &expected, const cyk_table &actual, TextView line)
+{
+    int length = expected.size();
+    for (int j = 0; j < length; j++)
+    {
+        for (int i = 0; i <= j; i++)
+        {
+            bool same = expected.at(i, j) == actual.at(i, j);
+            for (symbol_set symbols = expected.at(i, j); same && i < j && symbols != 0; symbols &= symbols - 1)
+            {
+                int slot = grammar.backpointer_slot[lowestSymbol(symbols)];
+                if (slot < 0 || !expected.hasBackpointers() || !actual.hasBackpointers())
+                    continue;
+                same = expected.backpointer(i, j, slot).split == actual.backpointer(i, j, slot).split &&
+                       expected.backpointer(i, j, slot).rule == actual.backpointer(i, j, slot).rule;
+            }
+            if (!same)
+            {
+                std::cerr << "verify: charts differ at cell (" << i << ", " << j << ") of \"" << line.str() << "\""
+                          << std::endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Finds a split point and rule deriving symbol over the tokens i .. j by
+// scanning the chart, for charts filled without backpointers
+bool findSplit(const CompiledGrammar &grammar, const cyk_table &table, int symbol, int i, int j, Backpointer &found)
+{
+    for (int k = i; k < j; k++)
+    {
+        symbol_set left = table.at(i, k);
+        symbol_set right = table.at(k + 1, j);
+        for (int rule : grammar.binary_rules_of[symbol])
+        {
+            const BinaryRule &binary_rule = grammar.binary_rules[rule];
+            if ((left & symbolBit(binary_rule.first)) && (right & symbolBit(binary_rule.second)))
+            {
+                found.split = k;
+                found.rule = rule;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+int buildTree(const CompiledGrammar &grammar, const cyk_table &table, const std::vector<Token> &inputSplitted,
+              NodeArena &arena)
+{
+    arena.reset();
+
+    int inputLength = inputSplitted.size();
+    int initialNode = arena.add(grammar.start_symbol, 0, inputLength - 1);
+
+    for (int index = initialNode; index < arena.size(); index++)
+    {
+        TreeNode node = arena[index];
+        if (node.isLeaf())
+            continue;
+
+        Backpointer split;
+        if (table.hasBackpointers())
+            split = table.backpointer(node.first, node.last, grammar.backpointer_slot[node.symbol]);
+        else if (!findSplit(grammar, table, node.symbol, node.first, node.last, split))
+            break;
+
+        const BinaryRule &rule = grammar.binary_rules[split.rule];
+        int leftNode = arena.add(rule.first, node.first, split.split);
+        int rightNode = arena.add(rule.second, split.split + 1, node.last);
+
+        arena[index].left = leftNode;
+        arena[index].right = rightNode;
+    }
+
+    return initialNode;
+}
+
+PredictiveParser::PredictiveParser(const CompiledGrammar &grammar)
+    : S(grammar.symbolId("S")), A(grammar.symbolId("A")), B(grammar.symbolId("B")), C(grammar.symbolId("C")),
+      D(grammar.symbolId("D")), E(grammar.symbolId("E")), F(grammar.symbolId("F")), G(grammar.symbolId("G")),
+      H(grammar.symbolId("H"))
+{
+}
+
+int PredictiveParser::parse(const std::vector<Token> &tokens, NodeArena &arena)
+{
+    arena.reset();
+    frames.clear();
+    terms.clear();
+
+    int size = (int)tokens.size();
+    int position = 0;
+    bool expect_term = true;
+    while (true)
+    {
+        if (expect_term)
+        {
+            if (position >= size)
+                return no_node;
+
+            TokenKind kind = tokens[position].kind;
+            if (kind == TokenKind::VARIABLE)
+            {
+                terms.push_back(arena.add(S, position, position));
+                position++;
+                expect_term = false;
+            }
+            else if (kind == TokenKind::LPAREN && position + 1 < size && tokens[position + 1].kind == TokenKind::LAMBDA)
+            {
+                if (!expect(tokens, position + 2, TokenKind::LPAREN))
+                    return no_node;
+                frames.push_back({ABSTRACTION_BINDER, position, 0});
+                position += 3;
+            }
+            else if (kind == TokenKind::LPAREN)
+            {
+                frames.push_back({APPLICATION_FUNCTION, position, 0});
+                position++;
+            }
+            else
+            {
+                return no_node;
+            }
+            continue;
+        }
+
+        // A term has just been completed
+        if (frames.empty())
+            break;
+
+        Frame &frame = frames.back();
+        switch (frame.state)
+        {
+        case APPLICATION_FUNCTION:
+            frame.state = APPLICATION_ARGUMENT;
+            expect_term = true;
+            break;
+        case APPLICATION_ARGUMENT:
+            if (!expect(tokens, position, TokenKind::RPAREN))
+                return no_node;
+            completeApplication(arena, frame.open, position);
+            frames.pop_back();
+            position++;
+            break;
+        case ABSTRACTION_BINDER:
+            if (!expect(tokens, position, TokenKind::RPAREN))
+                return no_node;
+            frame.binder_close = position;
+            frame.state = ABSTRACTION_BODY;
+            position++;
+            expect_term = true;
+            break;
+        case ABSTRACTION_BODY:
+            if (!expect(tokens, position, TokenKind::RPAREN))
+                return no_node;
+            completeAbstraction(arena, frame.open, frame.binder_close, position);
+            frames.pop_back();
+            position++;
+            break;
+        }
+    }
+
+    if (position != size)
+        return no_node;
+    return terms.back();
+}
+
+bool PredictiveParser::expect(const std::vector<Token> &tokens, int position, TokenKind kind)
+{
+    return position < (int)tokens.size() && tokens[position].kind == kind;
+}
+
+int PredictiveParser::addNode(NodeArena &arena, int symbol, int left, int right)
+{
+    int node = arena.add(symbol, arena[left].first, arena[right].last);
+    arena[node].left = left;
+    arena[node].right = right;
+    return node;
+}
+
+void PredictiveParser::completeApplication(NodeArena &arena, int open, int close)
+{
+    int argument = terms.back();
+    terms.pop_back();
+    int function = terms.back();
+    terms.pop_back();
+
+    int a = addNode(arena, A, arena.add(C, open, open), function);
+    int b = addNode(arena, B, argument, arena.add(D, close, close));
+    terms.push_back(addNode(arena, S, a, b));
+}
+
+void PredictiveParser::completeAbstraction(NodeArena &arena, int open, int binder_close, int close)
+{
+    int body = terms.back();
+    terms.pop_back();
+    int binder = terms.back();
+    terms.pop_back();
+
+    int e = addNode(arena, E, arena.add(C, open, open), arena.add(G, open + 1, open + 1));
+    int a = addNode(arena, A, arena.add(C, open + 2, open + 2), binder);
+    int h = addNode(arena, H, a, arena.add(D, binder_close, binder_close));
+    int b = addNode(arena, B, body, arena.add(D, close, close));
+    int f = addNode(arena, F, h, b);
+    terms.push_back(addNode(arena, S, e, f));
+}
+
+bool fillChart(const CompiledGrammar &grammar, ParseEngine engine, const ChartConfig &config, TextView line,
+               const std::vector<Token> &tokens, cyk_table &table, ChartScratch &scratch)
+{
+    bool record_backpointers = config.recordsBackpointers(grammar, (int)tokens.size());
+    bool accepted = engine == ParseEngine::MATRIX
+                        ? matrixParse(grammar, line, tokens, table, scratch, config, record_backpointers)
+                        : cykParse(grammar, line, tokens, table, scratch, config, record_backpointers);
+    if (config.verify_failures != nullptr && (engine == ParseEngine::MATRIX || config.kernel != nextSplitScalar))
+    {
+        ChartConfig reference = config;
+        reference.kernel = nextSplitScalar;
+        cyk_table expected;
+        ChartScratch expected_scratch;
+        if (cykParse(grammar, line, tokens, expected, expected_scratch, reference, record_backpointers) != accepted ||
+            !sameChart(grammar, expected, table, line))
+            (*config.verify_failures)++;
+    }
+    return accepted;
+}
+
+void FreeVariableCollector::reset(TextView newLine, const std::vector<Token> &newTokens)
+{
+    line = newLine;
+    tokens = &newTokens;
+
+    std::size_t slot_count = 16;
+    while (slot_count < 2 * newTokens.size())
+        slot_count *= 2;
+    slots.assign(slot_count, -1);
+    variable_tokens.clear();
+    last_binding.clear();
+    bindings.clear();
+    binder_sizes.clear();
+    collected.clear();
+    binder_starts.clear();
+}
+
+void FreeVariableCollector::occurrence(int token)
+{
+    int variable = intern(token);
+    int binding = last_binding[variable];
+    if (binding < 0 || bindings[binding].depth != (int)binder_starts.size())
+        collected.push_back(variable);
+}
+
+void FreeVariableCollector::beginBinder()
+{
+    binder_starts.push_back(collected.size());
+}
+
+void FreeVariableCollector::endBinder()
+{
+    std::size_t start = binder_starts.back();
+    binder_starts.pop_back();
+
+    int depth = (int)binder_starts.size();
+    for (std::size_t index = start; index < collected.size(); index++)
+    {
+        int variable = collected[index];
+        Binding binding = {variable, depth, last_binding[variable]};
+        last_binding[variable] = (int)bindings.size();
+        bindings.push_back(binding);
+    }
+    binder_sizes.push_back(collected.size() - start);
+    collected.resize(start);
+}
+
+void FreeVariableCollector::unbind()
+{
+    for (std::size_t count = binder_sizes.back(); count > 0; count--)
+    {
+        last_binding[bindings.back().variable] = bindings.back().previous;
+        bindings.pop_back();
+    }
+    binder_sizes.pop_back();
+}
+
+void FreeVariableCollector::result(std::vector<std::string> &variables) const
+{
+    variables.clear();
+    for (int variable : collected)
+        variables.push_back(tokenText(line, (*tokens)[variable_tokens[variable]]).str());
+}
+
+TextView FreeVariableCollector::text(int token) const
+{
+    return tokenText(line, (*tokens)[token]);
+}
+
+int FreeVariableCollector::intern(int token)
+{
+    TextView name = text(token);
+    std::size_t hash = 2166136261u;
+    for (std::size_t i = 0; i < name.size; i++)
+        hash = (hash ^ (unsigned char)name.data[i]) * 16777619u;
+
+    std::size_t mask = slots.size() - 1;
+    for (std::size_t slot = hash & mask;; slot = (slot + 1) & mask)
+    {
+        int variable = slots[slot];
+        if (variable < 0)
+        {
+            variable = (int)variable_tokens.size();
+            slots[slot] = variable;
+            variable_tokens.push_back(token);
+            last_binding.push_back(-1);
+            return variable;
+        }
+
+        TextView known = text(variable_tokens[variable]);
+        if (known.size == name.size && std::equal(name.data, name.data + name.size, known.data))
+            return variable;
+    }
+}
+
+const int end_binder_step = -1;
+
+const int unbind_step = -2;
+
+// Markers of the walk over a tree, apart from no_node
+const int end_binder_node = -2;
+
+const int unbind_node = -3;
+
+void collectFreeVariables(const CompiledGrammar &grammar, const cyk_table &table, TextView line,
+                          const std::vector<Token> &tokens, FreeVariableCollector &collector,
+                          std::vector<DerivationStep> &stack, std::vector<std::string> &variables)
+{
+    int binder_symbol = binderSymbol(grammar);
+
+    collector.reset(line, tokens);
+    stack.clear();
+    stack.push_back({grammar.start_symbol, 0, (int)tokens.size() - 1});
+
+    while (!stack.empty())
+    {
+        DerivationStep step = stack.back();
+        stack.pop_back();
+
+        if (step.symbol == end_binder_step)
+        {
+            collector.endBinder();
+            continue;
+        }
+        if (step.symbol == unbind_step)
+        {
+            collector.unbind();
+            continue;
+        }
+
+        if (step.first == step.last)
+        {
+            if (tokens[step.first].kind == TokenKind::VARIABLE)
+                collector.occurrence(step.first);
+            continue;
+        }
+
+        Backpointer split;
+        if (table.hasBackpointers())
+            split = table.backpointer(step.first, step.last, grammar.backpointer_slot[step.symbol]);
+        else if (!findSplit(grammar, table, step.symbol, step.first, step.last, split))
+            continue;
+
+        const BinaryRule &rule = grammar.binary_rules[split.rule];
+        DerivationStep left = {rule.first, step.first, split.split};
+        DerivationStep right = {rule.second, split.split + 1, step.last};
+
+        // Pushed in reverse: the binder, its end, the body, then unbind
+        if (step.symbol == binder_symbol)
+        {
+            stack.push_back({unbind_step, 0, 0});
+            stack.push_back(right);
+            stack.push_back({end_binder_step, 0, 0});
+            stack.push_back(left);
+            collector.beginBinder();
+        }
+        else
+        {
+            stack.push_back(right);
+            stack.push_back(left);
+        }
+    }
+
+    collector.result(variables);
+}
+
+void collectFreeVariables(const ParseTree &tree, int root, FreeVariableCollector &collector, std::vector<int> &stack,
+                          std::vector<std::string> &variables)
+{
+    collector.reset(tree.line, tree.tokens);
+    stack.clear();
+    if (root != no_node)
+        stack.push_back(root);
+
+    while (!stack.empty())
+    {
+        int index = stack.back();
+        stack.pop_back();
+
+        if (index == end_binder_node)
+        {
+            collector.endBinder();
+            continue;
+        }
+        if (index == unbind_node)
+        {
+            collector.unbind();
+            continue;
+        }
+
+        const TreeNode &node = tree.arena[index];
+        if (node.isLeaf())
+        {
+            if (tree.tokens[node.first].kind == TokenKind::VARIABLE)
+                collector.occurrence(node.first);
+            continue;
+        }
+
+        // Pushed in reverse: the binder, its end, the body, then unbind
+        if (node.symbol == tree.binder_symbol)
+        {
+            stack.push_back(unbind_node);
+            if (node.right != no_node)
+                stack.push_back(node.right);
+            stack.push_back(end_binder_node);
+            if (node.left != no_node)
+                stack.push_back(node.left);
+            collector.beginBinder();
+        }
+        else
+        {
+            if (node.right != no_node)
+                stack.push_back(node.right);
+            if (node.left != no_node)
+                stack.push_back(node.left);
+        }
+    }
+
+    collector.result(variables);
+}
+
+bool ParseSession::accepted() const
+{
+    int length = chart_.size();
+    return length > 0 && (chart_.at(0, length - 1) & symbolBit(grammar_.start_symbol)) != 0;
+}
+
+ParseSession::ParseSession(const CompiledGrammar &grammar, const ChartConfig &config)
+    : grammar_(grammar), config_(config)
+{
+    requireSupportedGrammar(grammar);
+}
+
+void ParseSession::clear()
+{
+    text_.clear();
+    tokens_.clear();
+    chart_.reset(0);
+    rows_.clear();
+}
+
+bool ParseSession::append(TextView more)
+{
+    std::size_t old_size = text_.size();
+    text_.append(more.data, more.size);
+
+    // The lexer looks a few characters past a token, at most the length
+    // of "lambda" and a hyphen, so only the tokens that close to the old
+    // end of the text can lex differently now. Lex again from the first
+    // of them
+    const std::size_t lookahead = 8;
+    std::size_t kept = tokens_.size();
+    while (kept > 0 && tokens_[kept - 1].offset + tokens_[kept - 1].length + lookahead > old_size)
+        kept--;
+    std::size_t from = kept > 0 ? tokens_[kept - 1].offset + tokens_[kept - 1].length : 0;
+
+    relexed_.clear();
+    Lexer lexer(TextView(text_), from);
+    Token token;
+    while (lexer.next(token))
+        relexed_.push_back(token);
+
+    // Columns of the tokens that came out the same are still valid
+    std::size_t same = kept;
+    while (same < tokens_.size() && same - kept < relexed_.size())
+    {
+        const Token &old_token = tokens_[same];
+        const Token &new_token = relexed_[same - kept];
+        if (old_token.offset != new_token.offset || old_token.length != new_token.length ||
+            old_token.kind != new_token.kind)
+            break;
+        same++;
+    }
+    tokens_.resize(kept);
+    tokens_.insert(tokens_.end(), relexed_.begin(), relexed_.end());
+
+    // Drop the columns from the first changed token on, then fill the
+    // columns of the tokens after it. Column j only reads columns before it
+    // Backpointers are only recorded from the first column on, so a chart
+    // that dropped them records them again only when it is refilled whole
+    int length = (int)tokens_.size();
+    bool record_backpointers = config_.recordsBackpointers(grammar_, length);
+    if (same == 0)
+        chart_.reset(0, record_backpointers ? grammar_.backpointer_slots : 0);
+    else if (!record_backpointers && chart_.hasBackpointers())
+        chart_.dropBackpointers();
+    record_backpointers = chart_.hasBackpointers();
+    chart_.resize((int)same);
+    rows_.resize(same);
+    for (std::size_t i = 0; i < same; i++)
+        rows_[i].resize(same - i);
+    chart_.resize(length);
+    rows_.resize(length);
+
+    ChartCounters counters = {0, 0};
+    for (int j = (int)same; j < length; j++)
+    {
+        symbol_set leaf = grammar_.terminalSymbols(tokens_[j].kind, tokenText(TextView(text_), tokens_[j]));
+        chart_.at(j, j) = leaf;
+        rows_[j].assign(1, leaf);
+        for (int i = j - 1; i >= 0; i--)
+        {
+            symbol_set cell = fillCell(grammar_, chart_, i, j, rows_[i].data(), chart_.column(j) + i + 1,
+                                       record_backpointers, config_.kernel, counters);
+            rows_[i].push_back(cell);
+        }
+    }
+
+    return accepted();
+}
+
+// Markers of the walk that writes a tree, apart from the node indices
+const int close_node = -2;
+
+const int separate_node = -3;
+
+void formatTree(const CompiledGrammar &grammar, const ParseTree &tree, int root, std::string &out)
+{
+    out.clear();
+    std::vector<int> stack;
+    if (root != no_node)
+        stack.push_back(root);
+
+    while (!stack.empty())
+    {
+        int index = stack.back();
+        stack.pop_back();
+
+        if (index == close_node)
+        {
+            out += ']';
+            continue;
+        }
+        if (index == separate_node)
+        {
+            out += ' ';
+            continue;
+        }
+
+        const TreeNode &node = tree.arena[index];
+        out += '[';
+        out += grammar.symbols[node.symbol];
+        if (node.isLeaf())
+        {
+            TextView token = tokenText(tree.line, tree.tokens[node.first]);
+            out += ' ';
+            out.append(token.data, token.size);
+            out += ']';
+            continue;
+        }
+
+        out += ' ';
+        stack.push_back(close_node);
+        if (node.right != no_node)
+            stack.push_back(node.right);
+        stack.push_back(separate_node);
+        if (node.left != no_node)
+            stack.push_back(node.left);
+    }
+}
+
+inline std::uint64_t saturatingAdd(std::uint64_t a, std::uint64_t b)
+{
+    return a > saturated_count - b ? saturated_count : a + b;
+}
+
+inline std::uint64_t saturatingMultiply(std::uint64_t a, std::uint64_t b)
+{
+    return b != 0 && a > saturated_count / b ? saturated_count : a * b;
+}
+
+int ParseForest::intern(int symbol, int first, int last)
+{
+    std::uint64_t key = ((std::uint64_t)first << 40) ^ ((std::uint64_t)last << 16) ^ (std::uint64_t)symbol;
+    auto found = index.find(key);
+    if (found != index.end())
+        return found->second;
+
+    ForestNode node = {symbol, first, last, 0, 0, 0};
+    nodes.push_back(node);
+    int id = (int)nodes.size() - 1;
+    index.emplace(key, id);
+    pending.push_back(id);
+    return id;
+}
+
+void ParseForest::build(const CompiledGrammar &grammar, const cyk_table &table, const std::vector<Token> &tokens)
+{
+    nodes.clear();
+    packed.clear();
+    index.clear();
+    pending.clear();
+    if (tokens.empty())
+        return;
+
+    // The alternatives of a node are the binary rules of its symbol whose
+    // two symbols are in the cells of a split point. Nodes are added as
+    // they are first reached from the root, which is nodes[0]
+    intern(grammar.start_symbol, 0, (int)tokens.size() - 1);
+    while (!pending.empty())
+    {
+        int id = pending.back();
+        pending.pop_back();
+        ForestNode node = nodes[id];
+
+        int packed_begin = (int)packed.size();
+        for (int split = node.first; split < node.last; split++)
+        {
+            symbol_set left = table.at(node.first, split);
+            symbol_set right = table.at(split + 1, node.last);
+            if ((left & grammar.first_symbols) == 0 || (right & grammar.second_symbols) == 0)
+                continue;
+
+            for (int rule : grammar.binary_rules_of[node.symbol])
+            {
+                const BinaryRule &binary_rule = grammar.binary_rules[rule];
+                if ((left & symbolBit(binary_rule.first)) && (right & symbolBit(binary_rule.second)))
+                {
+                    PackedNode alternative = {intern(binary_rule.first, node.first, split),
+                                              intern(binary_rule.second, split + 1, node.last), 0};
+                    packed.push_back(alternative);
+                }
+            }
+        }
+        nodes[id].packed_begin = packed_begin;
+        nodes[id].packed_end = (int)packed.size();
+    }
+
+    // Count the derivations of the shorter spans first: the children of a
+    // node always cover fewer tokens than the node
+    for (int id = 0; id < (int)nodes.size(); id++)
+        pending.push_back(id);
+    std::sort(pending.begin(), pending.end(), [this](int a, int b) {
+        return nodes[a].last - nodes[a].first < nodes[b].last - nodes[b].first;
+    });
+    for (int id : pending)
+    {
+        ForestNode &node = nodes[id];
+        if (node.first == node.last)
+        {
+            node.count = 1;
+            continue;
+        }
+        node.count = 0;
+        for (int alternative = node.packed_begin; alternative < node.packed_end; alternative++)
+        {
+            PackedNode &packed_node = packed[alternative];
+            packed_node.count = saturatingMultiply(nodes[packed_node.left].count, nodes[packed_node.right].count);
+            node.count = saturatingAdd(node.count, packed_node.count);
+        }
+    }
+    pending.clear();
+}
+
+int ParseForest::tree(std::uint64_t rank, NodeArena &arena)
+{
+    arena.reset();
+    if (nodes.empty())
+        return no_node;
+
+    // The rank of a node picks the alternative whose derivations cover it,
+    // then splits what is left of it between the two children, the right
+    // one varying fastest
+    int root = arena.add(nodes[0].symbol, nodes[0].first, nodes[0].last);
+    subtrees.clear();
+    subtrees.push_back({0, root, rank});
+    while (!subtrees.empty())
+    {
+        Subtree subtree = subtrees.back();
+        subtrees.pop_back();
+
+        const ForestNode &node = nodes[subtree.node];
+        std::uint64_t node_rank = subtree.rank;
+        if (node.first == node.last)
+            continue;
+
+        int alternative = node.packed_begin;
+        while (alternative + 1 < node.packed_end && node_rank >= packed[alternative].count)
+        {
+            node_rank -= packed[alternative].count;
+            alternative++;
+        }
+        const PackedNode &packed_node = packed[alternative];
+        const ForestNode &left = nodes[packed_node.left];
+        const ForestNode &right = nodes[packed_node.right];
+
+        int left_node = arena.add(left.symbol, left.first, left.last);
+        int right_node = arena.add(right.symbol, right.first, right.last);
+        arena[subtree.tree_node].left = left_node;
+        arena[subtree.tree_node].right = right_node;
+
+        subtrees.push_back({packed_node.right, right_node, node_rank % right.count});
+        subtrees.push_back({packed_node.left, left_node, node_rank / right.count});
+    }
+    return root;
+}
+
+void buildAst(const ParseTree &tree, int root, std::vector<AstNode> &nodes, std::string &names,
+              std::vector<std::pair<int, int>> &stack)
+{
+    // Each entry is a tree node to convert, or, with a node index second,
+    // the end of the subtree of that node
+    stack.clear();
+    if (root != no_node)
+        stack.push_back(std::make_pair(root, -1));
+
+    while (!stack.empty())
+    {
+        std::pair<int, int> step = stack.back();
+        stack.pop_back();
+
+        if (step.second >= 0)
+        {
+            nodes[step.second].size = (std::uint32_t)(nodes.size() - step.second);
+            continue;
+        }
+
+        const TreeNode &node = tree.arena[step.first];
+        if (node.isLeaf())
+        {
+            TextView name = tokenText(tree.line, tree.tokens[node.first]);
+            AstNode variable = {AST_VARIABLE, 1, (std::uint32_t)names.size()};
+            nodes.push_back(variable);
+            names.append(name.data, name.size);
+            names += '\0';
+            continue;
+        }
+
+        // ( S1 S2 ) is S -> A B with A -> C S1 and B -> S2 D, and
+        // ( lambda ( S1 ) S2 ) is S -> E F with F -> H B, H -> A D,
+        // A -> C S1 and B -> S2 D
+        const TreeNode &right = tree.arena[node.right];
+        int first;
+        int second;
+        AstNode term = {AST_APPLICATION, 0, 0};
+        if (right.symbol == tree.binder_symbol)
+        {
+            term.kind = AST_ABSTRACTION;
+            first = tree.arena[tree.arena[right.left].left].right;
+            second = tree.arena[right.right].left;
+        }
+        else
+        {
+            first = tree.arena[node.left].right;
+            second = right.left;
+        }
+
+        stack.push_back(std::make_pair(step.first, (int)nodes.size()));
+        nodes.push_back(term);
+        stack.push_back(std::make_pair(second, -1));
+        stack.push_back(std::make_pair(first, -1));
+    }
+}
+
+bool AstWriter::open(const std::string &path)
+{
+    file.open(path, std::ios::binary | std::ios::trunc);
+    if (!file)
+        return false;
+
+    // Zeroed until close(), so an unfinished file has no magic
+    AstFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    file.write((const char *)&header, sizeof(header));
+    return (bool)file;
+}
+
+void AstWriter::add(std::uint64_t case_number, const std::vector<AstNode> &nodes, const std::string &names)
+{
+    if (nodes.empty())
+        return;
+
+    AstTerm term = {case_number, node_count};
+    terms.push_back(term);
+
+    std::string name;
+    for (AstNode node : nodes)
+    {
+        if (node.kind == AST_VARIABLE)
+        {
+            name.assign(names.c_str() + node.name);
+            auto found = string_ids.find(name);
+            if (found == string_ids.end())
+            {
+                found = string_ids.emplace(name, (std::uint32_t)string_offsets.size()).first;
+                string_offsets.push_back(string_data.size());
+                string_data.append(name.c_str(), name.size() + 1);
+            }
+            node.name = found->second;
+        }
+        buffer.append((const char *)&node, sizeof(node));
+    }
+    node_count += nodes.size();
+
+    if (buffer.size() >= (1 << 20))
+        flush();
+}
+
+void AstWriter::flush()
+{
+    file.write(buffer.data(), buffer.size());
+    buffer.clear();
+}
+
+bool AstWriter::close()
+{
+    flush();
+
+    // The terms and string offsets are 8-byte aligned after the nodes
+    AstFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::uint64_t end = sizeof(header) + node_count * sizeof(AstNode);
+    std::uint64_t padding = (8 - end % 8) % 8;
+    file.write("\0\0\0\0\0\0\0", padding);
+    header.terms_offset = end + padding;
+    file.write((const char *)terms.data(), terms.size() * sizeof(AstTerm));
+
+    string_offsets.push_back(string_data.size());
+    header.strings_offset = header.terms_offset + terms.size() * sizeof(AstTerm);
+    file.write((const char *)string_offsets.data(), string_offsets.size() * sizeof(std::uint64_t));
+    file.write(string_data.data(), string_data.size());
+
+    std::memcpy(header.magic, ast_magic, sizeof(header.magic));
+    header.version = ast_format_version;
+    header.byte_order = ast_byte_order;
+    header.node_size = sizeof(AstNode);
+    header.node_count = node_count;
+    header.term_count = terms.size();
+    header.string_count = string_offsets.size() - 1;
+    file.seekp(0);
+    file.write((const char *)&header, sizeof(header));
+    file.close();
+    return !file.fail();
+}
+
+bool LineValidator::check(const std::vector<Token> &tokens, RejectReason &reason, std::size_t &position)
+{
+    reason = RejectReason::NONE;
+    position = 0;
+    frames.clear();
+    frames.push_back({TOP_TERM, 0});
+    for (const Token &token : tokens)
+    {
+        position = token.offset;
+        Frame &frame = frames.back();
+        switch (frame.state)
+        {
+        case TOP_TERM:
+        case APPLICATION_FIRST:
+        case APPLICATION_SECOND:
+        case BINDER_TERM:
+        case BODY_TERM:
+            if (token.kind == TokenKind::VARIABLE)
+            {
+                completeTerm();
+            }
+            else if (token.kind == TokenKind::LPAREN)
+            {
+                frames.push_back({APPLICATION_FIRST, token.offset});
+            }
+            else if (token.kind == TokenKind::LAMBDA)
+            {
+                // Only right after the "(" of a term
+                if (frame.state != APPLICATION_FIRST)
+                    return reject(RejectReason::MISPLACED_LAMBDA, reason);
+                frame.state = LAMBDA_BINDER;
+            }
+            else
+            {
+                return reject(frames.size() == 1 ? RejectReason::UNMATCHED_CLOSE : RejectReason::EXPECTED_TERM,
+                              reason);
+            }
+            break;
+        case LAMBDA_BINDER:
+            if (token.kind != TokenKind::LPAREN)
+                return reject(RejectReason::MISSING_BINDER, reason);
+            frame.state = BINDER_TERM;
+            break;
+        case BINDER_CLOSE:
+            if (token.kind != TokenKind::RPAREN)
+                return reject(RejectReason::BINDER_NOT_CLOSED, reason);
+            frame.state = BODY_TERM;
+            break;
+        case APPLICATION_CLOSE:
+        case BODY_CLOSE:
+            if (token.kind != TokenKind::RPAREN)
+                return reject(RejectReason::TOO_MANY_TERMS, reason);
+            frames.pop_back();
+            completeTerm();
+            break;
+        case TOP_END:
+            return reject(token.kind == TokenKind::RPAREN ? RejectReason::UNMATCHED_CLOSE
+                                                          : RejectReason::TRAILING_TOKENS,
+                          reason);
+        }
+    }
+
+    if (frames.back().state == TOP_END)
+        return true;
+    if (frames.size() == 1)
+        return reject(RejectReason::EMPTY_LINE, reason);
+    position = frames.back().open;
+    return reject(RejectReason::UNCLOSED_PAREN, reason);
+}
+
+bool LineValidator::onlyTokens(TextView line, const std::vector<Token> &tokens, std::size_t &position)
+{
+    std::size_t from = 0;
+    for (std::size_t index = 0; index <= tokens.size(); index++)
+    {
+        std::size_t to = index < tokens.size() ? tokens[index].offset : line.size;
+        for (position = from; position < to; position++)
+        {
+            if (!std::isspace((unsigned char)line.data[position]))
+                return false;
+        }
+        if (index < tokens.size())
+            from = tokens[index].offset + tokens[index].length;
+    }
+    return true;
+}
+
+bool LineValidator::reject(RejectReason why, RejectReason &reason)
+{
+    reason = why;
+    return false;
+}
+
+void LineValidator::completeTerm()
+{
+    State &state = frames.back().state;
+    switch (state)
+    {
+    case TOP_TERM:
+        state = TOP_END;
+        break;
+    case APPLICATION_FIRST:
+        state = APPLICATION_SECOND;
+        break;
+    case APPLICATION_SECOND:
+        state = APPLICATION_CLOSE;
+        break;
+    case BINDER_TERM:
+        state = BINDER_CLOSE;
+        break;
+    case BODY_TERM:
+        state = BODY_CLOSE;
+        break;
+    default:
+        break;
+    }
+}
+
+const char *rejectReasonText(RejectReason reason)
+{
+    switch (reason)
+    {
+    case RejectReason::NONE:
+        return "not derived by the grammar";
+    case RejectReason::EMPTY_LINE:
+        return "empty line";
+    case RejectReason::STRAY_CHARACTER:
+        return "character that is not part of any token";
+    case RejectReason::UNMATCHED_CLOSE:
+        return "\")\" without a matching \"(\"";
+    case RejectReason::UNCLOSED_PAREN:
+        return "\"(\" that is never closed";
+    case RejectReason::EXPECTED_TERM:
+        return "expected a term";
+    case RejectReason::MISPLACED_LAMBDA:
+        return "\"lambda\" that does not follow \"(\"";
+    case RejectReason::MISSING_BINDER:
+        return "\"lambda\" without a \"(\" binder";
+    case RejectReason::BINDER_NOT_CLOSED:
+        return "binder of more than one term";
+    case RejectReason::TOO_MANY_TERMS:
+        return "more than two terms in parentheses";
+    case RejectReason::TRAILING_TOKENS:
+        return "text after the end of the term";
+    case RejectReason::OUT_OF_MEMORY:
+        return "line too long for the memory of its chart";
+    }
+    return "";
+}
+
+void ResultCache::makeKey(TextView line, const std::vector<Token> &tokens, std::string &key)
+{
+    key.clear();
+    for (const Token &token : tokens)
+    {
+        if (!key.empty())
+            key += ' ';
+        key.append(line.data + token.offset, token.length);
+    }
+}
+
+bool ResultCache::find(const std::string &key, CaseResult &result)
+{
+    std::uint64_t hash = hashKey(key);
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = index.find(hash);
+    if (it == index.end() || it->second->key != key)
+        return false;
+
+    entries.splice(entries.begin(), entries, it->second);
+    result.accepted = it->second->accepted;
+    result.free_variables = it->second->free_variables;
+    result.derivations = it->second->derivations;
+    result.trees = it->second->trees;
+    result.ast = it->second->ast;
+    result.ast_names = it->second->ast_names;
+    return true;
+}
+
+void ResultCache::insert(const std::string &key, const CaseResult &result)
+{
+    std::uint64_t hash = hashKey(key);
+    Entry entry = {hash,           key,          result.accepted, result.free_variables, result.derivations,
+                   result.trees, result.ast, result.ast_names};
+    std::size_t bytes = entryBytes(entry);
+    if (bytes > budget)
+        return;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    // Another worker may have added the key meanwhile, or a different
+    // key with the same hash may be there: the new entry replaces it
+    auto it = index.find(hash);
+    if (it != index.end())
+        erase(it->second);
+
+    entries.push_front(std::move(entry));
+    index[hash] = entries.begin();
+    used += bytes;
+    while (used > budget)
+        erase(std::prev(entries.end()));
+}
+
+std::uint64_t ResultCache::hashKey(const std::string &key)
+{
+    std::uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : key)
+    {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+std::size_t ResultCache::entryBytes(const Entry &entry)
+{
+    std::size_t bytes = sizeof(Entry) + 64 + entry.key.size();
+    for (const std::string &variable : entry.free_variables)
+        bytes += sizeof(std::string) + variable.size();
+    for (const std::string &tree : entry.trees)
+        bytes += sizeof(std::string) + tree.size();
+    bytes += entry.ast.size() * sizeof(AstNode) + entry.ast_names.size();
+    return bytes;
+}
+
+void ResultCache::erase(std::list<Entry>::iterator entry)
+{
+    used -= entryBytes(*entry);
+    index.erase(entry->hash);
+    entries.erase(entry);
+}
+
+Parser::Parser(const CompiledGrammar &grammar, const EvaluationOptions &options)
+    : grammar_(grammar), options_(options), binder_symbol_(binderSymbol(grammar)), predictive_(grammar), root_(no_node)
+{
+    requireSupportedGrammar(grammar);
+    if (!isBuiltinGrammar(grammar))
+    {
+        if (options_.build_ast)
+            throw std::invalid_argument("ASTs are only built for the built-in grammar");
+        if (options_.engine == ParseEngine::LL)
+            options_.engine = ParseEngine::CYK;
+        options_.prevalidate = false;
+    }
+    if (options_.engine == ParseEngine::LL && (options_.count_derivations || options_.enumerate_trees > 0))
+        options_.engine = ParseEngine::CYK;
+}
+
+bool Parser::parse(TextView line)
+{
+    {
+        STATS_TIME(STAGE_TOKENIZE);
+        tokenize(line, tokens_);
+    }
+    return parseTokens(line, true);
+}
+
+void Parser::evaluate(TextView line, CaseResult &case_result)
+{
+    case_result.free_variables.clear();
+    case_result.derivations = 0;
+    case_result.trees.clear();
+    case_result.ast.clear();
+    case_result.ast_names.clear();
+    case_result.reject_reason = RejectReason::NONE;
+    case_result.reject_position = 0;
+
+    {
+        STATS_TIME(STAGE_TOKENIZE);
+        tokenize(line, tokens_);
+    }
+
+    // Before the cache, whose keys ignore the characters the lexer
+    // skips
+    if (options_.strict || options_.prevalidate)
+    {
+        bool valid;
+        {
+            STATS_TIME(STAGE_VALIDATE);
+            if (options_.strict && !LineValidator::onlyTokens(line, tokens_, case_result.reject_position))
+            {
+                case_result.reject_reason = RejectReason::STRAY_CHARACTER;
+                valid = false;
+            }
+            else
+            {
+                valid = !options_.prevalidate ||
+                        validator_.check(tokens_, case_result.reject_reason, case_result.reject_position);
+            }
+        }
+        if (!valid)
+        {
+            STATS_ADD(early_rejects, 1);
+            case_result.accepted = false;
+            return;
+        }
+    }
+
+    if (options_.cache)
+    {
+        ResultCache::makeKey(line, tokens_, cache_key_);
+        if (options_.cache->find(cache_key_, case_result))
+        {
+            STATS_ADD(cache_hits, 1);
+            return;
+        }
+        STATS_ADD(cache_misses, 1);
+    }
+
+    try
+    {
+        evaluateTokens(line, case_result);
+    }
+    catch (const std::bad_alloc &)
+    {
+        case_result.accepted = false;
+        case_result.reject_reason = RejectReason::OUT_OF_MEMORY;
+        return;
+    }
+
+    if (options_.cache)
+        options_.cache->insert(cache_key_, case_result);
+}
+
+void Parser::evaluate(TextView line, CaseResult &case_result, ParseStats *totals, bool per_case)
+{
+#ifndef CYK_NO_STATS
+    if (totals)
+    {
+        ParseStats line_stats;
+        active_stats = &line_stats;
+        evaluate(line, case_result);
+        active_stats = nullptr;
+
+        line_stats.lines = 1;
+        line_stats.accepted = case_result.accepted ? 1 : 0;
+        line_stats.tokens = (long long)tokens_.size();
+        totals->merge(line_stats);
+        if (per_case)
+            case_result.stats = line_stats;
+        return;
+    }
+#endif
+    evaluate(line, case_result);
+}
+
+bool Parser::parseTokens(TextView line, bool build_tree)
+{
+    root_ = no_node;
+    if (options_.engine == ParseEngine::LL)
+    {
+        STATS_TIME(STAGE_PARSE);
+        root_ = predictive_.parse(tokens_, arena_);
+    }
+    else
+    {
+        bool accepted;
+        {
+            STATS_TIME(STAGE_PARSE);
+            accepted = fillChart(grammar_, options_.engine, options_.chart, line, tokens_, chart_, scratch_);
+        }
+        if (!build_tree || !accepted)
+            return accepted;
+
+        STATS_TIME(STAGE_TREE);
+        root_ = buildTree(grammar_, chart_, tokens_, arena_);
+    }
+
+    if (root_ != no_node)
+        STATS_ADD(tree_nodes, arena_.size());
+    return root_ != no_node;
+}
+
+void Parser::evaluateTokens(TextView line, CaseResult &case_result)
+{
+    bool from_chart = options_.engine != ParseEngine::LL && options_.free_variables_only && !options_.build_ast;
+    case_result.accepted = parseTokens(line, !from_chart);
+    if (!case_result.accepted)
+        return;
+
+    {
+        STATS_TIME(STAGE_FREE_VARIABLES);
+        if (from_chart)
+        {
+            collectFreeVariables(grammar_, chart_, line, tokens_, collector_, steps_, case_result.free_variables);
+        }
+        else
+        {
+            ParseTree tree = {arena_, line, tokens_, binder_symbol_};
+            collectFreeVariables(tree, root_, collector_, nodes_, case_result.free_variables);
+        }
+    }
+
+    if (options_.build_ast)
+    {
+        ParseTree tree = {arena_, line, tokens_, binder_symbol_};
+        buildAst(tree, root_, case_result.ast, case_result.ast_names, ast_stack_);
+    }
+
+    if (options_.count_derivations || options_.enumerate_trees > 0)
+    {
+        STATS_TIME(STAGE_FOREST);
+        forest_.build(grammar_, chart_, tokens_);
+        STATS_ADD(forest_nodes, forest_.size() + forest_.packedSize());
+        if (options_.count_derivations)
+            case_result.derivations = forest_.derivations();
+
+        // The trees are built one at a time by rank, in the arena of
+        // the tree of the line, which is no longer needed
+        ParseTree tree = {arena_, line, tokens_, binder_symbol_};
+        for (std::uint64_t rank = 0; rank < (std::uint64_t)options_.enumerate_trees && rank < forest_.derivations();
+             rank++)
+        {
+            case_result.trees.emplace_back();
+            formatTree(grammar_, tree, forest_.tree(rank, arena_), case_result.trees.back());
+        }
+        root_ = no_node;
+    }
+}
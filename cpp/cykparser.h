@@ -0,0 +1,1587 @@
+// CYK parser for the simple lambda calculus, as a library: grammars,
+// the chart engines, parse trees, free variables and the Parser context
+#ifndef CYKPARSER_H
+#define CYKPARSER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <regex>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <list>
+#include <unordered_map>
+#include <stdexcept>
+#include <cstring>
+#include <cctype>
+
+// Set of grammar symbols, one bit per symbol id
+using symbol_set = std::uint32_t;
+
+const int max_symbols = 32;
+
+inline symbol_set symbolBit(int symbol)
+{
+    return symbol_set(1) << symbol;
+}
+
+// Id of the lowest symbol in a non-empty set
+inline int lowestSymbol(symbol_set symbols)
+{
+    return __builtin_ctz(symbols);
+}
+
+// Split point and binary rule of the first derivation found for one
+// symbol of a chart cell
+struct Backpointer
+{
+    int split;
+    int rule;
+};
+
+// CYK chart with one symbol set per cell (i, j), i <= j, kept in a single
+// triangular buffer. Each column j is stored contiguously as (0, j) .. (j, j),
+// so the cells (k + 1, j) combined while filling (i, j) are adjacent.
+// Optionally it also keeps a backpointer per cell for each of
+// backpointerSlots symbols
+class CykChart
+{
+public:
+    CykChart() : length(0), slots(0) {}
+
+    explicit CykChart(int length, int backpointerSlots = 0)
+    {
+        reset(length, backpointerSlots);
+    }
+
+    void reset(int newLength, int backpointerSlots = 0)
+    {
+        length = newLength;
+        slots = backpointerSlots;
+        cells.assign(cellCount(), 0);
+        backpointers.resize(cellCount() * slots);
+    }
+
+    // Keeps the columns before newLength and adds empty ones up to it.
+    // Columns are stored one after the other, so the kept cells do not
+    // move
+    void resize(int newLength)
+    {
+        length = newLength;
+        cells.resize(cellCount(), 0);
+        backpointers.resize(cellCount() * slots);
+    }
+
+    int size() const
+    {
+        return length;
+    }
+
+    bool hasBackpointers() const
+    {
+        return slots != 0;
+    }
+
+    // Frees the backpointers and keeps the cells
+    void dropBackpointers()
+    {
+        slots = 0;
+        std::vector<Backpointer>().swap(backpointers);
+    }
+
+    symbol_set &at(int i, int j)
+    {
+        return cells[cellIndex(i, j)];
+    }
+
+    symbol_set at(int i, int j) const
+    {
+        return cells[cellIndex(i, j)];
+    }
+
+    // Cells (0, j) .. (j, j), stored contiguously
+    const symbol_set *column(int j) const
+    {
+        return &cells[cellIndex(0, j)];
+    }
+
+    Backpointer &backpointer(int i, int j, int slot)
+    {
+        return backpointers[cellIndex(i, j) * slots + slot];
+    }
+
+    const Backpointer &backpointer(int i, int j, int slot) const
+    {
+        return backpointers[cellIndex(i, j) * slots + slot];
+    }
+
+private:
+    std::size_t cellCount() const
+    {
+        return (std::size_t)length * (length + 1) / 2;
+    }
+
+    static std::size_t cellIndex(int i, int j)
+    {
+        return (std::size_t)j * (j + 1) / 2 + i;
+    }
+
+    int length;
+    int slots;
+    std::vector<symbol_set> cells;
+    std::vector<Backpointer> backpointers;
+};
+
+using cyk_table = CykChart;
+
+using grammar_type = std::map<std::string, std::vector<std::vector<std::string>>>;
+
+// Terminal pattern matching a single variable name
+constexpr char variable_regex[] = "(?!lambda)[a-zA-Z]+(-[a-zA-Z]+)*";
+
+extern const std::string variable_pattern;
+
+// A rule of the built-in grammar: left_side -> first second, or
+// left_side -> first for a terminal rule, which has no second
+struct BuiltinRule
+{
+    const char *left_side;
+    const char *first;
+    const char *second;
+};
+
+// Rules of the grammar, as literals the compiler can read when it is
+// built with CYK_FIXED_GRAMMAR
+constexpr BuiltinRule builtin_rules[] = {
+    {"S", "A", "B"}, {"S", "E", "F"}, {"S", variable_regex, nullptr},
+    {"A", "C", "S"},
+    {"B", "S", "D"},
+    {"C", "(", nullptr},
+    {"D", ")", nullptr},
+    {"E", "C", "G"},
+    {"F", "H", "B"},
+    {"G", "lambda", nullptr},
+    {"H", "A", "D"}};
+
+constexpr int builtin_rule_count = sizeof(builtin_rules) / sizeof(builtin_rules[0]);
+
+grammar_type builtinGrammar();
+
+#ifdef CYK_FIXED_GRAMMAR
+// Compile-time tables of the built-in grammar. The symbol ids are the
+// ones compileGrammar gives it, where the left sides come first in the
+// order of the grammar map, so they follow the sorted symbol names
+
+constexpr bool sameText(const char *a, const char *b)
+{
+    return *a == *b && (*a == '\0' || sameText(a + 1, b + 1));
+}
+
+constexpr bool lessText(const char *a, const char *b)
+{
+    return *a < *b || (*a == *b && *a != '\0' && lessText(a + 1, b + 1));
+}
+
+constexpr bool isBuiltinLeftSide(const char *name, int rule = 0)
+{
+    return rule < builtin_rule_count && (sameText(builtin_rules[rule].left_side, name) || isBuiltinLeftSide(name, rule + 1));
+}
+
+// Whether no rule before rule has the same left side
+constexpr bool firstRuleOf(int rule, int earlier = 0)
+{
+    return earlier == rule ||
+           (!sameText(builtin_rules[earlier].left_side, builtin_rules[rule].left_side) && firstRuleOf(rule, earlier + 1));
+}
+
+// Number of distinct left sides sorting before name
+constexpr int fixedSymbolId(const char *name, int rule = 0)
+{
+    return rule == builtin_rule_count
+               ? 0
+               : (firstRuleOf(rule) && lessText(builtin_rules[rule].left_side, name) ? 1 : 0) + fixedSymbolId(name, rule + 1);
+}
+
+constexpr int fixedSymbolCount(int rule = 0)
+{
+    return rule == builtin_rule_count ? 0 : (firstRuleOf(rule) ? 1 : 0) + fixedSymbolCount(rule + 1);
+}
+
+constexpr bool isBinaryRule(int rule)
+{
+    return builtin_rules[rule].second != nullptr;
+}
+
+// Every symbol on the right side of a binary rule has rules of its own
+constexpr bool binaryRulesClosed(int rule = 0)
+{
+    return rule == builtin_rule_count ||
+           ((!isBinaryRule(rule) ||
+             (isBuiltinLeftSide(builtin_rules[rule].first) && isBuiltinLeftSide(builtin_rules[rule].second))) &&
+            binaryRulesClosed(rule + 1));
+}
+
+constexpr int fixed_start_symbol = fixedSymbolId("S");
+constexpr int fixed_binder_symbol = fixedSymbolId("F");
+
+static_assert(fixedSymbolCount() <= max_symbols, "the built-in grammar has too many symbols");
+static_assert(binaryRulesClosed(), "the built-in grammar is not in Chomsky normal form");
+static_assert(isBuiltinLeftSide("S") && isBuiltinLeftSide("F"), "the built-in grammar lacks its start or binder symbol");
+static_assert(fixedSymbolId("A") == 0 && fixed_start_symbol == fixedSymbolCount() - 1,
+              "the fixed symbol ids do not follow the order of the grammar map");
+
+// combine for the built-in grammar, unrolled over its rules at compile
+// time: each binary rule A -> B C costs a shift and two ANDs
+template <int rule>
+struct FixedCombine
+{
+    static symbol_set apply(symbol_set left, symbol_set right)
+    {
+        return apply(left, right, std::integral_constant<bool, isBinaryRule(rule)>()) |
+               FixedCombine<rule + 1>::apply(left, right);
+    }
+
+    static symbol_set apply(symbol_set left, symbol_set right, std::true_type)
+    {
+        const int first = fixedSymbolId(builtin_rules[rule].first);
+        const int second = fixedSymbolId(builtin_rules[rule].second);
+        const int left_side = fixedSymbolId(builtin_rules[rule].left_side);
+        return (((left >> first) & (right >> second)) & 1u) << left_side;
+    }
+
+    static symbol_set apply(symbol_set, symbol_set, std::false_type)
+    {
+        return 0;
+    }
+};
+
+template <>
+struct FixedCombine<builtin_rule_count>
+{
+    static symbol_set apply(symbol_set, symbol_set)
+    {
+        return 0;
+    }
+};
+#endif
+
+// Non-owning view of a piece of text, such as an input line
+struct TextView
+{
+    const char *data;
+    std::size_t size;
+
+    TextView() : data(nullptr), size(0) {}
+    TextView(const char *data, std::size_t size) : data(data), size(size) {}
+    TextView(const std::string &text) : data(text.data()), size(text.size()) {}
+
+    std::string str() const
+    {
+        return std::string(data, size);
+    }
+};
+
+// Kind of a single token, as recognised by classifyToken
+enum class TokenKind
+{
+    LPAREN,
+    RPAREN,
+    LAMBDA,
+    VARIABLE,
+    INVALID
+};
+
+const int token_kind_count = 5;
+
+inline bool isLetter(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+// A -> B C, with every symbol given by its id
+struct BinaryRule
+{
+    int left_side;
+    int first;
+    int second;
+};
+
+// A -> terminal, where the terminal is matched against a single token
+struct TerminalRule
+{
+    int left_side;
+    std::string pattern;
+};
+
+// A terminal rule that is not a whole token kind, compiled once. Patterns
+// that are not valid regular expressions match their exact text
+struct TerminalMatcher
+{
+    int left_side;
+    bool is_regex;
+    std::regex regex;
+    std::string literal;
+
+    bool matches(TextView token) const
+    {
+        if (is_regex)
+            return std::regex_match(token.data, token.data + token.size, regex);
+        return literal.size() == token.size && literal.compare(0, literal.size(), token.data, token.size) == 0;
+    }
+};
+
+// The grammar with every symbol interned to a small integer id and the
+// binary rules indexed by their right side, so the CYK loops never touch
+// strings or walk the grammar map
+struct CompiledGrammar
+{
+    std::vector<std::string> symbols;
+    std::map<std::string, int> symbol_ids;
+    std::vector<BinaryRule> binary_rules;
+    std::vector<TerminalRule> terminal_rules;
+    // binary_index[B * symbols.size() + C] is the set of every A with A -> B C
+    std::vector<symbol_set> binary_index;
+    // Ids of the rules A -> B C for each A
+    std::vector<std::vector<int>> binary_rules_of;
+    // Backpointer slot of each symbol that is the left side of a binary
+    // rule, -1 for the others
+    std::vector<int> backpointer_slot;
+    int backpointer_slots;
+    // Symbols that appear as B or C in some rule A -> B C
+    symbol_set first_symbols;
+    symbol_set second_symbols;
+    // token_symbols[kind] is the set of A with A -> terminal matching
+    // every token of that kind
+    symbol_set token_symbols[token_kind_count];
+    // Remaining terminal rules, tested against each token
+    std::vector<TerminalMatcher> terminal_matchers;
+    int start_symbol;
+
+    int symbolCount() const
+    {
+        return (int)symbols.size();
+    }
+
+    // Id of the named symbol, or -1 if the grammar has no such symbol
+    int symbolId(const std::string &name) const
+    {
+        auto it = symbol_ids.find(name);
+        return it != symbol_ids.end() ? it->second : -1;
+    }
+
+    const symbol_set *producers(int first) const
+    {
+        return &binary_index[first * symbols.size()];
+    }
+
+    // Set of every A with A -> B C for some B in left and C in right
+    symbol_set combine(symbol_set left, symbol_set right) const
+    {
+#ifdef CYK_FIXED_GRAMMAR
+        return FixedCombine<0>::apply(left, right);
+#else
+        symbol_set produced = 0;
+        left &= first_symbols;
+        right &= second_symbols;
+        if (left == 0 || right == 0)
+            return produced;
+
+        for (; left != 0; left &= left - 1)
+        {
+            const symbol_set *row = producers(lowestSymbol(left));
+            for (symbol_set rights = right; rights != 0; rights &= rights - 1)
+                produced |= row[lowestSymbol(rights)];
+        }
+        return produced;
+#endif
+    }
+
+    // Symbols A with A -> terminal matching a token of the given kind
+    symbol_set terminalSymbols(TokenKind kind, TextView token) const
+    {
+        symbol_set symbols = token_symbols[(int)kind];
+        for (const TerminalMatcher &matcher : terminal_matchers)
+        {
+            if (matcher.matches(token))
+                symbols |= symbolBit(matcher.left_side);
+        }
+        return symbols;
+    }
+};
+
+CompiledGrammar compileGrammar(const grammar_type &rules, const std::string &start_symbol);
+
+// The built-in grammar, compiled
+CompiledGrammar builtinCompiledGrammar();
+
+// Whether the grammar is the built-in one, with the same symbol ids and
+// rules, the only grammar the predictive parser, the LineValidator and
+// the AST know
+bool isBuiltinGrammar(const CompiledGrammar &grammar);
+
+// Symbol whose left child binds variables in its right child, -1 if the
+// grammar has none
+inline int binderSymbol(const CompiledGrammar &grammar)
+{
+#ifdef CYK_FIXED_GRAMMAR
+    return fixed_binder_symbol;
+#else
+    return grammar.symbolId("F");
+#endif
+}
+
+#ifdef CYK_FIXED_GRAMMAR
+// Whether the compile-time tables derive the same symbols as the rule
+// index compiled at startup, for every pair of symbols
+bool fixedGrammarMatches(const CompiledGrammar &compiled);
+#endif
+
+// CompiledGrammar::combine and binderSymbol are defined differently with
+// CYK_FIXED_GRAMMAR, so the library and its clients must agree on it. The
+// library defines the marker of the mode it was built in and every file
+// including this header refers to the marker of its own mode, so linking
+// a client built in the other mode fails on an undefined symbol
+#ifdef CYK_FIXED_GRAMMAR
+extern const int cyk_fixed_grammar_build;
+__attribute__((used)) static const int *const cyk_grammar_build = &cyk_fixed_grammar_build;
+#else
+extern const int cyk_dynamic_grammar_build;
+__attribute__((used)) static const int *const cyk_grammar_build = &cyk_dynamic_grammar_build;
+#endif
+
+// Read-only memory mapping of a whole file
+class MappedFile
+{
+public:
+    MappedFile() : data(nullptr), size(0) {}
+
+    ~MappedFile();
+
+    bool open(const std::string &path);
+
+    const char *data;
+    std::size_t size;
+
+private:
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+};
+
+// Reads the productions of a JFLAP grammar file, which must be in Chomsky
+// normal form. The start symbol is the left side of the first production
+grammar_type parseJffGrammar(const std::string &xml, std::string &start_symbol);
+
+std::string serializeGrammar(const CompiledGrammar &compiled);
+
+bool isCompiledGrammar(const char *data, std::size_t size);
+
+CompiledGrammar deserializeGrammar(const char *data, std::size_t size);
+
+// Loads a grammar from a JFLAP .jff file or from a grammar compiled with
+// --save-grammar, told apart by the first bytes of the file. Throws
+// std::runtime_error if the file cannot be read or is not a valid grammar,
+// and std::invalid_argument in a CYK_FIXED_GRAMMAR build if it is not the
+// built-in grammar
+CompiledGrammar loadGrammar(const std::string &path);
+
+// A token of an input line, given by its position in the line
+struct Token
+{
+    std::uint32_t offset;
+    std::uint32_t length;
+    TokenKind kind;
+};
+
+inline TextView tokenText(TextView line, const Token &token)
+{
+    return TextView(line.data + token.offset, token.length);
+}
+
+// Replaces the contents of tokens with the tokens of the line, reusing
+// the buffer so tokenizing allocates nothing once it has grown
+void tokenize(TextView line, std::vector<Token> &tokens);
+
+// Stages of the pipeline timed by ParseStats
+enum Stage
+{
+    STAGE_TOKENIZE,
+    STAGE_VALIDATE,
+    STAGE_PARSE,
+    STAGE_TREE,
+    STAGE_FREE_VARIABLES,
+    STAGE_FOREST,
+    STAGE_COUNT
+};
+
+const char *const stage_names[STAGE_COUNT] = {"tokenize", "validate", "parse", "build_tree",
+                                                     "free_variables", "forest"};
+
+// Counters and stage timings of the lines evaluated while a ParseStats is
+// active on the thread. Building with -DCYK_NO_STATS compiles all of the
+// instrumentation out; otherwise it costs a null check per stage and per
+// parse when no ParseStats is active
+struct ParseStats
+{
+    long long lines;
+    long long accepted;
+    long long tokens;
+    long long chart_cells;
+    // Split points where both cells were non-empty, so the binary rules
+    // had to be looked up
+    long long rule_applications;
+    // Symbols stored in chart cells
+    long long chart_entries;
+    long long tree_nodes;
+    // Nodes and packed nodes of the parse forests
+    long long forest_nodes;
+    // Lines answered from the ResultCache, and lines looked up but missing
+    long long cache_hits;
+    long long cache_misses;
+    // Lines rejected by the LineValidator, before any parsing
+    long long early_rejects;
+    double stage_seconds[STAGE_COUNT];
+
+    ParseStats()
+        : lines(0), accepted(0), tokens(0), chart_cells(0), rule_applications(0), chart_entries(0), tree_nodes(0),
+          forest_nodes(0), cache_hits(0), cache_misses(0),
+          early_rejects(0)
+    {
+        std::fill(stage_seconds, stage_seconds + STAGE_COUNT, 0.0);
+    }
+
+    void merge(const ParseStats &other)
+    {
+        lines += other.lines;
+        accepted += other.accepted;
+        tokens += other.tokens;
+        chart_cells += other.chart_cells;
+        rule_applications += other.rule_applications;
+        chart_entries += other.chart_entries;
+        tree_nodes += other.tree_nodes;
+        forest_nodes += other.forest_nodes;
+        cache_hits += other.cache_hits;
+        cache_misses += other.cache_misses;
+        early_rejects += other.early_rejects;
+        for (int stage = 0; stage < STAGE_COUNT; stage++)
+            stage_seconds[stage] += other.stage_seconds[stage];
+    }
+};
+
+#ifndef CYK_NO_STATS
+// Stats of the line being evaluated on this thread, if they are collected
+extern thread_local ParseStats *active_stats;
+
+// Adds the time until the end of the scope to a stage of the active stats
+class StageTimer
+{
+public:
+    explicit StageTimer(Stage stage) : stage(stage)
+    {
+        if (active_stats)
+            start = std::chrono::steady_clock::now();
+    }
+
+    ~StageTimer()
+    {
+        if (active_stats)
+        {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            active_stats->stage_seconds[stage] += elapsed.count();
+        }
+    }
+
+private:
+    Stage stage;
+    std::chrono::steady_clock::time_point start;
+};
+
+#define STATS_ADD(counter, amount)                \
+    do                                            \
+    {                                             \
+        if (active_stats)                         \
+            active_stats->counter += (amount);    \
+    } while (0)
+#define STATS_TIME(stage) StageTimer stage_timer_##stage(stage)
+#else
+#define STATS_ADD(counter, amount) \
+    do                             \
+    {                              \
+        (void)(amount);            \
+    } while (0)
+#define STATS_TIME(stage) \
+    do                    \
+    {                     \
+    } while (0)
+#endif
+
+// Fixed set of threads running parallelFor jobs. The calling thread takes
+// part in every job as worker 0, so a pool of size one runs jobs inline
+class WorkerPool
+{
+public:
+    explicit WorkerPool(int size)
+        : task(nullptr), job_count(0), job_chunk(1), next_index(0),
+          generation(0), busy_workers(0), stopping(false)
+    {
+        for (int worker = 1; worker < size; worker++)
+            threads.emplace_back(&WorkerPool::workerLoop, this, worker);
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        job_ready.notify_all();
+        for (std::thread &thread : threads)
+            thread.join();
+    }
+
+    int size() const
+    {
+        return (int)threads.size() + 1;
+    }
+
+    // Calls task(index, worker) for every index in [0, count). Workers
+    // take chunk indices at a time from a shared counter, so slow items
+    // do not hold up the items queued behind them. Jobs from several
+    // threads run one after the other
+    void parallelFor(std::size_t count, std::size_t chunk, const std::function<void(std::size_t, int)> &function)
+    {
+        if (threads.empty() || count <= chunk)
+        {
+            for (std::size_t index = 0; index < count; index++)
+                function(index, 0);
+            return;
+        }
+
+        std::lock_guard<std::mutex> job_lock(job_mutex);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task = &function;
+            job_count = count;
+            job_chunk = chunk;
+            next_index = 0;
+            busy_workers = (int)threads.size();
+            generation++;
+        }
+        job_ready.notify_all();
+
+        runJob(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        job_done.wait(lock, [this] { return busy_workers == 0; });
+        task = nullptr;
+    }
+
+private:
+    void workerLoop(int worker)
+    {
+        int seen_generation = 0;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                job_ready.wait(lock, [&] { return stopping || generation != seen_generation; });
+                if (stopping)
+                    return;
+                seen_generation = generation;
+            }
+
+            runJob(worker);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--busy_workers == 0)
+                job_done.notify_one();
+        }
+    }
+
+    void runJob(int worker)
+    {
+        while (true)
+        {
+            std::size_t start = next_index.fetch_add(job_chunk);
+            if (start >= job_count)
+                return;
+
+            std::size_t end = std::min(start + job_chunk, job_count);
+            for (std::size_t index = start; index < end; index++)
+                (*task)(index, worker);
+        }
+    }
+
+    std::vector<std::thread> threads;
+    std::mutex job_mutex;
+    std::mutex mutex;
+    std::condition_variable job_ready;
+    std::condition_variable job_done;
+    const std::function<void(std::size_t, int)> *task;
+    std::size_t job_count;
+    std::size_t job_chunk;
+    std::atomic<std::size_t> next_index;
+    int generation;
+    int busy_workers;
+    bool stopping;
+};
+
+// Inner loop of cykParse: the lowest k in from .. count - 1 where left[k]
+// has a symbol of firsts and right[k] one of seconds, the only split
+// points where a rule can apply, or count if there is none. There is a
+// scalar version and, on x86, SSE2 and AVX2 versions that test 4 or 8
+// split points per instruction, chosen at startup from what the CPU
+// supports
+using SplitKernel = int (*)(const symbol_set *left, const symbol_set *right, int from, int count,
+                            symbol_set firsts, symbol_set seconds);
+
+int nextSplitScalar(const symbol_set *left, const symbol_set *right, int from, int count, symbol_set firsts,
+                    symbol_set seconds);
+
+// Kernel selected with --kernel, by name. Fails for unknown names and
+// for kernels the CPU does not support
+bool findSplitKernel(const std::string &name, SplitKernel &kernel);
+
+const char *splitKernelName(SplitKernel kernel);
+
+SplitKernel selectSplitKernel();
+
+// How the chart engines fill a chart
+struct ChartConfig
+{
+    ChartConfig()
+        : kernel(selectSplitKernel()), pool(nullptr), parallel_threshold(2048), backpointer_budget(64 << 20),
+          verify_failures(nullptr)
+    {
+    }
+
+    // Inner loop of cykParse, by default the widest the CPU supports
+    SplitKernel kernel;
+
+    // Pool filling the cells of one chart in parallel for inputs of at
+    // least parallel_threshold tokens, or nullptr to fill every chart on
+    // the calling thread
+    WorkerPool *pool;
+    int parallel_threshold;
+
+    // Bytes the backpointers of one chart may take. They cost
+    // backpointer_slots * 8 bytes per cell, several times the cell
+    // itself, and make reading a tree back from the chart linear in its
+    // size. Charts whose backpointers would take more are filled without
+    // them, and each tree node then scans the split points of its span
+    std::size_t backpointer_budget;
+
+    // When set, every chart is checked against the one cykParse builds
+    // with the scalar kernel, and the lines whose charts differ are
+    // counted here
+    std::atomic<long long> *verify_failures;
+
+    // Whether the backpointers of a chart of length tokens fit in the
+    // budget
+    bool recordsBackpointers(const CompiledGrammar &grammar, int length) const
+    {
+        std::uint64_t cells = (std::uint64_t)length * (length + 1) / 2;
+        std::uint64_t cell_bytes = (std::uint64_t)grammar.backpointer_slots * sizeof(Backpointer);
+        return cell_bytes == 0 || cells <= backpointer_budget / cell_bytes;
+    }
+};
+
+// Bit matrices of the chart for the symbols used by binary rules: for a
+// first symbol B, row (B, i) has bit k set when B derives the tokens
+// i .. k, and for a second symbol C, column (C, j) has bit k set when C
+// derives the tokens k + 1 .. j. A derives i .. j through A -> B C exactly
+// when row (B, i) and column (C, j) share a bit, so each cell is a boolean
+// dot product taken 64 split points per word. The rows of all symbols at
+// one position are kept next to each other, as are the columns
+class BitMatrixChart
+{
+public:
+    void reset(const CompiledGrammar &grammar, int length)
+    {
+        words = (length + 63) / 64;
+        first_symbols = grammar.first_symbols;
+        second_symbols = grammar.second_symbols;
+        first_slot.assign(grammar.symbolCount(), -1);
+        second_slot.assign(grammar.symbolCount(), -1);
+        first_count = assignSlots(first_symbols, first_slot);
+        second_count = assignSlots(second_symbols, second_slot);
+        rows.assign((std::size_t)length * first_count * words, 0);
+        columns.assign((std::size_t)length * second_count * words, 0);
+    }
+
+    // Records that the symbols derive the tokens i .. j
+    void add(int i, int j, symbol_set symbols)
+    {
+        for (symbol_set firsts = symbols & first_symbols; firsts != 0; firsts &= firsts - 1)
+            row(lowestSymbol(firsts), i)[j >> 6] |= std::uint64_t(1) << (j & 63);
+
+        if (i == 0)
+            return;
+        for (symbol_set seconds = symbols & second_symbols; seconds != 0; seconds &= seconds - 1)
+            column(lowestSymbol(seconds), j)[(i - 1) >> 6] |= std::uint64_t(1) << ((i - 1) & 63);
+    }
+
+    // Lowest split point k in i .. j - 1 with first deriving i .. k and
+    // second deriving k + 1 .. j, or -1 if there is none
+    int lowestSplit(int first, int second, int i, int j) const
+    {
+        const std::uint64_t *left = row(first, i);
+        const std::uint64_t *right = column(second, j);
+        // Bits outside i .. j - 1 are clear in one of the two operands
+        for (int word = i >> 6, last = (j - 1) >> 6; word <= last; word++)
+        {
+            std::uint64_t common = left[word] & right[word];
+            if (common != 0)
+                return word * 64 + __builtin_ctzll(common);
+        }
+        return -1;
+    }
+
+private:
+    static int assignSlots(symbol_set symbols, std::vector<int> &slot)
+    {
+        int count = 0;
+        for (; symbols != 0; symbols &= symbols - 1)
+            slot[lowestSymbol(symbols)] = count++;
+        return count;
+    }
+
+    std::uint64_t *row(int symbol, int i)
+    {
+        return &rows[((std::size_t)i * first_count + first_slot[symbol]) * words];
+    }
+
+    const std::uint64_t *row(int symbol, int i) const
+    {
+        return &rows[((std::size_t)i * first_count + first_slot[symbol]) * words];
+    }
+
+    std::uint64_t *column(int symbol, int j)
+    {
+        return &columns[((std::size_t)j * second_count + second_slot[symbol]) * words];
+    }
+
+    const std::uint64_t *column(int symbol, int j) const
+    {
+        return &columns[((std::size_t)j * second_count + second_slot[symbol]) * words];
+    }
+
+    int words;
+    symbol_set first_symbols;
+    symbol_set second_symbols;
+    int first_count;
+    int second_count;
+    std::vector<int> first_slot;
+    std::vector<int> second_slot;
+    std::vector<std::uint64_t> rows;
+    std::vector<std::uint64_t> columns;
+};
+
+// Buffers the chart engines use next to the chart itself, kept between
+// lines so they are only allocated when a line is longer than any before
+struct ChartScratch
+{
+    // Row by row mirror of the chart for cykParse
+    std::vector<std::size_t> row_start;
+    std::vector<symbol_set> rows;
+    BitMatrixChart matrices;
+};
+
+// function to perform the CYK Algorithm. With record_backpointers the
+// chart also keeps how each symbol of each cell was first derived. The
+// chart is mirrored row by row, so the left cells (i, i) .. (i, j - 1)
+// combined while filling (i, j) are contiguous like the right ones and
+// the kernel can skip the split points with nothing to combine
+bool cykParse(const CompiledGrammar &grammar, TextView line, const std::vector<Token> &input_str,
+              cyk_table &solution_table, ChartScratch &scratch, const ChartConfig &config,
+              bool record_backpointers = false);
+
+// Fills the same chart as cykParse, and the same backpointers with
+// record_backpointers, from the bit
+// matrices of BitMatrixChart. Each rule A -> B C costs one AND per 64
+// split points instead of one set lookup per split point, which pays off
+// on inputs of thousands of tokens
+bool matrixParse(const CompiledGrammar &grammar, TextView line, const std::vector<Token> &input_str,
+                 cyk_table &solution_table, ChartScratch &scratch, const ChartConfig &config,
+                 bool record_backpointers = false);
+
+// Compares two charts of the same tokens, cells and backpointers, and
+// reports the first difference
+bool sameChart(const CompiledGrammar &grammar, const cyk_table &expected, const cyk_table &actual, TextView line);
+
+const int no_node = -1;
+
+// Parse tree node covering the tokens first .. last. Children are indices
+// into the NodeArena holding the tree, and a leaf (first == last) refers
+// to its token by index instead of copying it
+struct TreeNode
+{
+    int symbol;
+    int first;
+    int last;
+    int left;
+    int right;
+
+    bool isLeaf() const
+    {
+        return first == last;
+    }
+};
+
+// Storage for the nodes of one parse tree. reset() drops the nodes but
+// keeps the memory, so an arena reused across inputs stops allocating
+// once it has grown to the largest tree
+class NodeArena
+{
+public:
+    void reset()
+    {
+        nodes.clear();
+    }
+
+    int add(int symbol, int first, int last)
+    {
+        TreeNode node = {symbol, first, last, no_node, no_node};
+        nodes.push_back(node);
+        return (int)nodes.size() - 1;
+    }
+
+    TreeNode &operator[](int index)
+    {
+        return nodes[index];
+    }
+
+    const TreeNode &operator[](int index) const
+    {
+        return nodes[index];
+    }
+
+    int size() const
+    {
+        return (int)nodes.size();
+    }
+
+private:
+    std::vector<TreeNode> nodes;
+};
+
+// Builds the tree deriving the whole input from the start symbol into
+// arena, which is reset first, and returns the index of its root. Nodes
+// are expanded in breadth-first order straight from the arena, so with
+// backpointers this takes time linear in the size of the tree. Without,
+// each node scans the split points of its span for one that derives it
+int buildTree(const CompiledGrammar &grammar, const cyk_table &table, const std::vector<Token> &inputSplitted,
+              NodeArena &arena);
+
+// Linear-time predictive parser for the lambda grammar, which in its
+// original form is S -> ( S S ) | ( lambda ( S ) S ) | variable and is
+// LL(2): after "(" the next token tells the two rules apart. It builds
+// the same Chomsky normal form tree as buildTree does from the CYK chart,
+// with the symbol ids of the given grammar, which must be the built-in
+// one. Open terms are kept on an explicit stack, so deep nesting cannot
+// overflow the call stack
+class PredictiveParser
+{
+public:
+    explicit PredictiveParser(const CompiledGrammar &grammar);
+
+    // Parses the tokens into arena, which is reset first. Returns the
+    // index of the root, or no_node if the tokens are not a term
+    int parse(const std::vector<Token> &tokens, NodeArena &arena);
+
+private:
+    enum State
+    {
+        APPLICATION_FUNCTION,
+        APPLICATION_ARGUMENT,
+        ABSTRACTION_BINDER,
+        ABSTRACTION_BODY
+    };
+
+    // A term opened at token open and not yet complete
+    struct Frame
+    {
+        State state;
+        int open;
+        int binder_close;
+    };
+
+    static bool expect(const std::vector<Token> &tokens, int position, TokenKind kind);
+
+    int addNode(NodeArena &arena, int symbol, int left, int right);
+
+    // ( S1 S2 ) is S -> A B, A -> C S1, B -> S2 D
+    void completeApplication(NodeArena &arena, int open, int close);
+
+    // ( lambda ( S1 ) S2 ) is S -> E F, E -> C G, F -> H B, H -> A D,
+    // A -> C S1, B -> S2 D
+    void completeAbstraction(NodeArena &arena, int open, int binder_close, int close);
+
+    const int S, A, B, C, D, E, F, G, H;
+    std::vector<Frame> frames;
+    // Completed terms not yet part of a larger one
+    std::vector<int> terms;
+};
+
+// Why a line was rejected before parsing
+enum class RejectReason
+{
+    NONE,
+    EMPTY_LINE,
+    STRAY_CHARACTER,
+    UNMATCHED_CLOSE,
+    UNCLOSED_PAREN,
+    EXPECTED_TERM,
+    MISPLACED_LAMBDA,
+    MISSING_BINDER,
+    BINDER_NOT_CLOSED,
+    TOO_MANY_TERMS,
+    TRAILING_TOKENS,
+    // The chart of the line does not fit in memory
+    OUT_OF_MEMORY
+};
+
+const char *rejectReasonText(RejectReason reason);
+
+// Single pass over the tokens of a line that tells whether it is a term
+// of the built-in grammar, S -> ( S S ) | ( lambda ( S ) S ) | variable,
+// without building anything, so malformed lines are rejected in linear
+// time before any chart is allocated. It only keeps a stack of the open
+// parentheses
+class LineValidator
+{
+public:
+    // Returns whether the tokens are a term, and otherwise the reason and
+    // the offset in the line where it went wrong
+    bool check(const std::vector<Token> &tokens, RejectReason &reason, std::size_t &position);
+
+    // Whether everything between the tokens is whitespace, and otherwise
+    // the offset of the first other character, one the lexer skipped
+    static bool onlyTokens(TextView line, const std::vector<Token> &tokens, std::size_t &position);
+
+private:
+    // What the innermost open term expects next
+    enum State
+    {
+        TOP_TERM,
+        TOP_END,
+        APPLICATION_FIRST,
+        APPLICATION_SECOND,
+        APPLICATION_CLOSE,
+        LAMBDA_BINDER,
+        BINDER_TERM,
+        BINDER_CLOSE,
+        BODY_TERM,
+        BODY_CLOSE
+    };
+
+    struct Frame
+    {
+        State state;
+        // Offset of the "(" that opened the term
+        std::size_t open;
+    };
+
+    static bool reject(RejectReason why, RejectReason &reason);
+
+    // A term just ended inside the innermost open one
+    void completeTerm();
+
+    std::vector<Frame> frames;
+};
+
+// Engines that can parse a line into its derivation tree
+enum class ParseEngine
+{
+    // Predictive parser for the built-in lambda grammar, linear time
+    LL,
+    // CYK over the compiled grammar, the reference engine
+    CYK,
+    // CYK with the split points scanned as packed bit matrices, for very
+    // long inputs
+    MATRIX
+};
+
+// Fills the chart of a line with one of the chart engines, CYK or MATRIX,
+// and returns whether the line is accepted. The chart has backpointers
+// when they fit in the backpointer budget of the config. Throws
+// std::bad_alloc if the chart does not fit in memory
+bool fillChart(const CompiledGrammar &grammar, ParseEngine engine, const ChartConfig &config, TextView line,
+               const std::vector<Token> &tokens, cyk_table &table, ChartScratch &scratch);
+
+// A parse tree together with the line it was parsed from
+struct ParseTree
+{
+    const NodeArena &arena;
+    TextView line;
+    const std::vector<Token> &tokens;
+    // Symbol of the "(S) S)" part of an abstraction, whose first S binds
+    // its variables in the second
+    int binder_symbol;
+};
+
+// Collects the free variables of a term while its derivation is walked
+// left to right, in order of occurrence and with repeats: the variables
+// of the binder "(S)" of an abstraction are collected on their own and
+// bind their occurrences in its body. Variables are interned to
+// ids per line and the active bindings form a stack linked per variable,
+// so binding, unbinding and lookups all take constant time
+class FreeVariableCollector
+{
+public:
+    void reset(TextView newLine, const std::vector<Token> &newTokens);
+
+    // Variable token reached, free unless a binding of the current binder
+    // depth covers it
+    void occurrence(int token);
+
+    // The binder of an abstraction starts. Its variables are collected
+    // apart from the enclosing term and ignore the enclosing bindings
+    void beginBinder();
+
+    // The binder ended: its free variables stay bound until unbind()
+    void endBinder();
+
+    // The body of the abstraction ended
+    void unbind();
+
+    void result(std::vector<std::string> &variables) const;
+
+private:
+    struct Binding
+    {
+        int variable;
+        int depth;
+        int previous;
+    };
+
+    TextView text(int token) const;
+
+    // Id of the variable spelled by the token, in an open-addressing table
+    // keyed by the text of the first token with that spelling
+    int intern(int token);
+
+    TextView line;
+    const std::vector<Token> *tokens;
+    std::vector<int> slots;
+    std::vector<int> variable_tokens;
+    std::vector<int> last_binding;
+    std::vector<Binding> bindings;
+    std::vector<std::size_t> binder_sizes;
+    // Free variables found so far, followed by those of each open binder
+    std::vector<int> collected;
+    std::vector<std::size_t> binder_starts;
+};
+
+// Step of the walk over a derivation: a symbol over tokens first .. last,
+// or one of the markers below
+struct DerivationStep
+{
+    int symbol;
+    int first;
+    int last;
+};
+
+// Computes the free variables of the derivation of the whole input
+// straight from the chart, without building a tree, following the
+// backpointers when it has them as buildTree does. The walk
+// uses an explicit stack, so its depth does not depend on the nesting
+void collectFreeVariables(const CompiledGrammar &grammar, const cyk_table &table, TextView line,
+                          const std::vector<Token> &tokens, FreeVariableCollector &collector,
+                          std::vector<DerivationStep> &stack, std::vector<std::string> &variables);
+
+// Computes the free variables of the tree under root in the same way,
+// walking it with an explicit stack of node indices. It takes time linear
+// in the size of the tree whatever its depth
+void collectFreeVariables(const ParseTree &tree, int root, FreeVariableCollector &collector, std::vector<int> &stack,
+                          std::vector<std::string> &variables);
+
+// Writes the tree under root with its symbols, as [S [A [C (] [S x]] ..],
+// a leaf being its symbol and its token
+void formatTree(const CompiledGrammar &grammar, const ParseTree &tree, int root, std::string &out);
+
+// Derivation counts at or above this value are saturated to it
+const std::uint64_t saturated_count = ~std::uint64_t(0);
+
+// Shared packed parse forest of every derivation of a whole input, for
+// ambiguous grammars. A node is a symbol over a span of tokens, shared by
+// all the derivations using it, and its alternatives are packed nodes: a
+// binary rule, its split point and the two child nodes. It is built from
+// a chart, whose cells hold each symbol once, and only from the nodes
+// reachable from the start symbol, so its size stays polynomial in the
+// length of the input however many derivations there are. Derivations
+// are counted per node and any of them can be built by its rank without
+// listing the ones before
+class ParseForest
+{
+public:
+    // Builds the forest of the tokens from a chart that accepts them. The
+    // buffers are kept for the next input
+    void build(const CompiledGrammar &grammar, const cyk_table &table, const std::vector<Token> &tokens);
+
+    // Number of derivations of the input, saturated at saturated_count
+    std::uint64_t derivations() const
+    {
+        return nodes.empty() ? 0 : nodes[0].count;
+    }
+
+    int size() const
+    {
+        return (int)nodes.size();
+    }
+
+    int packedSize() const
+    {
+        return (int)packed.size();
+    }
+
+    // Builds the derivation of the given rank, 0 <= rank < derivations(),
+    // into arena, which is reset first, and returns its root. Rank 0 is the
+    // tree of the first alternative of every node, and the alternatives of
+    // a node are ordered by split point, then by rule
+    int tree(std::uint64_t rank, NodeArena &arena);
+
+private:
+    struct ForestNode
+    {
+        int symbol;
+        int first;
+        int last;
+        // Alternatives packed[packed_begin] .. packed[packed_end - 1]
+        int packed_begin;
+        int packed_end;
+        std::uint64_t count;
+    };
+
+    struct PackedNode
+    {
+        int left;
+        int right;
+        std::uint64_t count;
+    };
+
+    // Derivation of the given rank of a forest node, left to build under
+    // a tree node
+    struct Subtree
+    {
+        int node;
+        int tree_node;
+        std::uint64_t rank;
+    };
+
+    int intern(int symbol, int first, int last);
+
+    std::vector<ForestNode> nodes;
+    std::vector<PackedNode> packed;
+    // Node of each symbol and span, keyed by all three
+    std::unordered_map<std::uint64_t, int> index;
+    // Nodes whose alternatives are not built yet, then the nodes by span
+    std::vector<int> pending;
+    std::vector<Subtree> subtrees;
+};
+
+// Node of a lambda term in the flat AST format. The nodes of a term are
+// stored in preorder: the children of a node start right after it, the
+// second one size nodes of the first later
+enum AstKind : std::uint32_t
+{
+    // A variable, whose name is a string id
+    AST_VARIABLE,
+    // The function, then the argument
+    AST_APPLICATION,
+    // The binder term, then the body
+    AST_ABSTRACTION
+};
+
+struct AstNode
+{
+    std::uint32_t kind;
+    // Nodes of the subtree, this one included
+    std::uint32_t size;
+    // String id of a variable. While a term is still in a CaseResult, it
+    // is the offset of the name in CaseResult::ast_names instead
+    std::uint32_t name;
+};
+
+// Accepted case of an AST file and the index of its root node
+struct AstTerm
+{
+    std::uint64_t case_number;
+    std::uint64_t root;
+};
+
+// Start of an AST file. Everything is in host byte order, which the byte
+// order mark tells. After the header come node_count AstNodes, then, from
+// terms_offset, term_count AstTerms, and from strings_offset the
+// string_count + 1 offsets of the names in the string data that follows
+// them, each name ending with a NUL. The magic is written last, when the
+// file is complete
+struct AstFileHeader
+{
+    char magic[4];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    std::uint32_t node_size;
+    std::uint64_t node_count;
+    std::uint64_t term_count;
+    std::uint64_t terms_offset;
+    std::uint64_t string_count;
+    std::uint64_t strings_offset;
+    std::uint64_t reserved;
+};
+
+const char ast_magic[4] = {'C', 'Y', 'K', 'A'};
+const std::uint32_t ast_format_version = 1;
+const std::uint32_t ast_byte_order = 0x01020304;
+
+// Converts the tree of a term of the built-in grammar under root to AST
+// nodes, appended to nodes, with the variable names appended to names
+void buildAst(const ParseTree &tree, int root, std::vector<AstNode> &nodes, std::string &names,
+              std::vector<std::pair<int, int>> &stack);
+
+// Writes the ASTs of the accepted cases to a file as they come. Nodes are
+// written through a buffer in one sequential pass; the terms and the
+// interned names are kept until close(), which appends them and fills in
+// the header
+class AstWriter
+{
+public:
+    AstWriter() : node_count(0) {}
+
+    bool open(const std::string &path);
+
+    void add(std::uint64_t case_number, const std::vector<AstNode> &nodes, const std::string &names);
+
+    bool close();
+
+private:
+    void flush();
+
+    std::ofstream file;
+    std::string buffer;
+    std::uint64_t node_count;
+    std::vector<AstTerm> terms;
+    std::unordered_map<std::string, std::uint32_t> string_ids;
+    std::vector<std::uint64_t> string_offsets;
+    std::string string_data;
+};
+
+// Result of evaluating one input line
+struct CaseResult
+{
+    bool accepted;
+    std::vector<std::string> free_variables;
+    // Filled in when derivations are counted, and when they are enumerated
+    std::uint64_t derivations;
+    std::vector<std::string> trees;
+    // Filled in when ASTs are built
+    std::vector<AstNode> ast;
+    std::string ast_names;
+    // Set when the line was rejected by the LineValidator, with the offset
+    // in the line where it went wrong
+    RejectReason reject_reason;
+    std::size_t reject_position;
+    // Filled in when stats are collected per case
+    ParseStats stats;
+};
+
+// Results of the lines seen so far, keyed on their token sequence, so a
+// line repeated anywhere in the input is evaluated once. Entries are
+// found by a hash of the key and checked against the full key, and the
+// least recently used ones are evicted once the entries take more than
+// the byte budget. It is shared by every worker
+class ResultCache
+{
+public:
+    explicit ResultCache(std::size_t budget_bytes) : budget(budget_bytes), used(0) {}
+
+    // Token texts separated by single spaces, so lines that only differ
+    // in whitespace or in characters the lexer drops share an entry
+    static void makeKey(TextView line, const std::vector<Token> &tokens, std::string &key);
+
+    bool find(const std::string &key, CaseResult &result);
+
+    void insert(const std::string &key, const CaseResult &result);
+
+private:
+    struct Entry
+    {
+        std::uint64_t hash;
+        std::string key;
+        bool accepted;
+        std::vector<std::string> free_variables;
+        std::uint64_t derivations;
+        std::vector<std::string> trees;
+        std::vector<AstNode> ast;
+        std::string ast_names;
+    };
+
+    // FNV-1a
+    static std::uint64_t hashKey(const std::string &key);
+
+    // Approximate memory taken by an entry, its list node and index slot
+    static std::size_t entryBytes(const Entry &entry);
+
+    void erase(std::list<Entry>::iterator entry);
+
+    std::size_t budget;
+    std::size_t used;
+    std::mutex mutex;
+    // Most recently used first
+    std::list<Entry> entries;
+    std::unordered_map<std::uint64_t, std::list<Entry>::iterator> index;
+};
+
+// How each line is evaluated
+struct EvaluationOptions
+{
+    EvaluationOptions()
+        : engine(ParseEngine::LL), free_variables_only(false), count_derivations(false), enumerate_trees(0),
+          build_ast(false), prevalidate(false), strict(false), cache(nullptr)
+    {
+    }
+
+    ParseEngine engine;
+
+    // Kernel, threads and checks of the chart engines
+    ChartConfig chart;
+
+    // With a chart engine, compute the free variables straight from the
+    // chart instead of building the parse tree first
+    bool free_variables_only;
+
+    // Count the derivations of each accepted line, and write out the
+    // first enumerate_trees of them, from the parse forest of its chart.
+    // Either one makes the LL engine fall back to CYK
+    bool count_derivations;
+    int enumerate_trees;
+
+    // Convert the tree of each accepted line to AST nodes, for the
+    // built-in grammar only. It needs the tree even with
+    // free_variables_only
+    bool build_ast;
+
+    // Reject the lines that are not terms of the built-in grammar with a
+    // LineValidator before the cache and the parser see them, for the
+    // built-in grammar only. With strict, the characters the lexer skips
+    // reject a line too, whatever the grammar
+    bool prevalidate;
+    bool strict;
+
+    // Results of lines already seen, or nullptr to evaluate every line
+    ResultCache *cache;
+};
+
+// Parsing context for one thread. It owns the token buffer, the chart
+// and the node arena, which grow to the longest line seen and are reused
+// by every later call, so a line costs no allocation once the buffers
+// are large enough. The grammar is not copied and must outlive the
+// Parser; any number of Parsers can share it. With a grammar other than
+// the built-in one, the LL engine falls back to CYK and prevalidate is
+// ignored, and build_ast throws std::invalid_argument. A CYK_FIXED_GRAMMAR
+// build throws std::invalid_argument for any grammar but the built-in one
+class Parser
+{
+public:
+    explicit Parser(const CompiledGrammar &grammar, const EvaluationOptions &options = EvaluationOptions());
+
+    // Parses a line into a tree and returns whether it is accepted. The
+    // tokens, chart and tree stay valid until the next call
+    bool parse(TextView line);
+
+    // Runs the whole pipeline on one line
+    void evaluate(TextView line, CaseResult &case_result);
+
+    // Evaluates a line and adds its stats to totals. With per_case the
+    // stats of the line are also kept in the result
+    void evaluate(TextView line, CaseResult &case_result, ParseStats *totals, bool per_case);
+
+    const CompiledGrammar &grammar() const { return grammar_; }
+    const EvaluationOptions &options() const { return options_; }
+    const std::vector<Token> &tokens() const { return tokens_; }
+    // Filled by the chart engines only
+    const cyk_table &chart() const { return chart_; }
+    const NodeArena &tree() const { return arena_; }
+    // Filled by evaluate when derivations are counted or enumerated
+    const ParseForest &forest() const { return forest_; }
+    // Root of the last tree, or no_node if the last line was rejected
+    int root() const { return root_; }
+
+private:
+    // Parses the tokens of a line with the engine of the options. The
+    // chart engines stop after the chart unless build_tree is set; all
+    // engines accept the same lines and build the same tree
+    bool parseTokens(TextView line, bool build_tree);
+
+    // Evaluates a line already split into tokens_
+    void evaluateTokens(TextView line, CaseResult &case_result);
+
+    const CompiledGrammar &grammar_;
+    EvaluationOptions options_;
+    int binder_symbol_;
+    std::vector<Token> tokens_;
+    cyk_table chart_;
+    ChartScratch scratch_;
+    NodeArena arena_;
+    FreeVariableCollector collector_;
+    std::vector<DerivationStep> steps_;
+    std::vector<int> nodes_;
+    ParseForest forest_;
+    std::vector<std::pair<int, int>> ast_stack_;
+    PredictiveParser predictive_;
+    LineValidator validator_;
+    std::string cache_key_;
+    int root_;
+};
+
+// Parse of a term received a piece at a time, as typed in an editor.
+// Text is only ever appended: each append lexes the new text, refills
+// the chart columns of the tokens that changed and adds those of the new
+// tokens, so the chart of a term grows column by column instead of being
+// parsed again after every keystroke. Uses the CYK engine with the split
+// kernel of the config and records backpointers like fillChart, while
+// they fit in its budget; the grammar must outlive the session, and a
+// CYK_FIXED_GRAMMAR build throws std::invalid_argument for any grammar
+// but the built-in one
+class ParseSession
+{
+public:
+    explicit ParseSession(const CompiledGrammar &grammar, const ChartConfig &config = ChartConfig());
+
+    // Starts over with no text
+    void clear();
+
+    // Appends more text and returns whether the text so far is a term
+    bool append(TextView more);
+
+    bool accepted() const;
+
+    const std::string &text() const { return text_; }
+    const std::vector<Token> &tokens() const { return tokens_; }
+    // Chart of the tokens so far, for buildTree and collectFreeVariables.
+    // Once the text outgrows the backpointer budget the backpointers are
+    // dropped and not recorded again until the session starts over
+    const cyk_table &chart() const { return chart_; }
+
+private:
+    const CompiledGrammar &grammar_;
+    ChartConfig config_;
+    std::string text_;
+    std::vector<Token> tokens_;
+    // Tokens lexed again at the end of the previous text
+    std::vector<Token> relexed_;
+    cyk_table chart_;
+    // rows_[i][k - i] is the cell (i, k), kept row by row for the split
+    // kernel like the rows of cykParse
+    std::vector<std::vector<symbol_set>> rows_;
+};
+
+#endif
@@ -0,0 +1,192 @@
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+using namespace std;
+
+// Shape of the generated terms
+struct GeneratorOptions
+{
+    long lines;
+    // Approximate number of tokens per term
+    int size;
+    // Maximum nesting of applications and abstractions
+    int depth;
+    // Number of distinct variable names
+    int variables;
+    // Probability that a compound term is an abstraction
+    double lambda_density;
+    // Fraction of lines that are damaged into ill-formed terms
+    double invalid_ratio;
+    unsigned seed;
+};
+
+class TermGenerator
+{
+public:
+    explicit TermGenerator(const GeneratorOptions &options)
+        : options(options), random(options.seed)
+    {
+        for (int i = 0; i < options.variables; i++)
+            names.push_back(variableName(i));
+    }
+
+    std::string term()
+    {
+        std::string text;
+        appendTerm(text, options.size, options.depth);
+        if (chance(options.invalid_ratio))
+            damage(text);
+        return text;
+    }
+
+private:
+    // a, b, ..., z, aa, ab, ..., never starting with the keyword
+    static std::string variableName(int index)
+    {
+        std::string name;
+        do
+        {
+            name.insert(name.begin(), char('a' + index % 26));
+            index /= 26;
+        } while (index-- > 0);
+        return name.compare(0, 6, "lambda") == 0 ? "x" + name : name;
+    }
+
+    bool chance(double probability)
+    {
+        return std::uniform_real_distribution<double>(0.0, 1.0)(random) < probability;
+    }
+
+    int uniform(int low, int high)
+    {
+        return std::uniform_int_distribution<int>(low, high)(random);
+    }
+
+    const std::string &variable()
+    {
+        return names[uniform(0, (int)names.size() - 1)];
+    }
+
+    // Appends a term of about budget tokens nested at most depth levels
+    void appendTerm(std::string &text, int budget, int depth)
+    {
+        if (budget < 4 || depth <= 0)
+        {
+            text += variable();
+            return;
+        }
+
+        if (budget >= 7 && chance(options.lambda_density))
+        {
+            text += "(lambda (";
+            text += variable();
+            text += ") ";
+            appendTerm(text, budget - 6, depth - 1);
+            text += ")";
+            return;
+        }
+
+        int function_budget = uniform(1, budget - 3);
+        text += "(";
+        appendTerm(text, function_budget, depth - 1);
+        text += " ";
+        appendTerm(text, budget - 2 - function_budget, depth - 1);
+        text += ")";
+    }
+
+    // Breaks a well-formed term with a typical kind of garbage
+    void damage(std::string &text)
+    {
+        std::size_t position = (std::size_t)uniform(0, (int)text.size());
+        switch (uniform(0, 4))
+        {
+        case 0:
+            text.insert(position, "(");
+            break;
+        case 1:
+            text.insert(position, ")");
+            break;
+        case 2:
+            text.insert(position, " lambda ");
+            break;
+        case 3:
+            text.insert(position, " " + variable() + " ");
+            break;
+        default:
+            text.insert(0, "lambda");
+            break;
+        }
+    }
+
+    GeneratorOptions options;
+    std::mt19937 random;
+    std::vector<std::string> names;
+};
+
+void printUsage(const char *program)
+{
+    std::cerr << "Usage: " << program << " [options]" << std::endl
+              << "Writes random lambda terms in the input format of main" << std::endl
+              << "  --lines N      number of terms (default 1000)" << std::endl
+              << "  --size N       approximate tokens per term (default 100)" << std::endl
+              << "  --depth N      maximum nesting depth (default 64)" << std::endl
+              << "  --vars N       distinct variable names (default 8)" << std::endl
+              << "  --lambda P     probability of an abstraction (default 0.3)" << std::endl
+              << "  --invalid P    fraction of ill-formed terms (default 0.1)" << std::endl
+              << "  --seed N       random seed (default 1)" << std::endl;
+}
+
+bool parseOptions(int argc, char *argv[], GeneratorOptions &options)
+{
+    options.lines = 1000;
+    options.size = 100;
+    options.depth = 64;
+    options.variables = 8;
+    options.lambda_density = 0.3;
+    options.invalid_ratio = 0.1;
+    options.seed = 1;
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string arg = argv[i];
+        const char *value = argv[i + 1];
+        if (arg == "--lines")
+            options.lines = std::atol(value);
+        else if (arg == "--size")
+            options.size = std::atoi(value);
+        else if (arg == "--depth")
+            options.depth = std::atoi(value);
+        else if (arg == "--vars")
+            options.variables = std::atoi(value);
+        else if (arg == "--lambda")
+            options.lambda_density = std::atof(value);
+        else if (arg == "--invalid")
+            options.invalid_ratio = std::atof(value);
+        else if (arg == "--seed")
+            options.seed = (unsigned)std::atol(value);
+        else
+            return false;
+    }
+    return argc % 2 == 1 && options.lines >= 0 && options.size > 0 && options.variables > 0;
+}
+
+int main(int argc, char *argv[])
+{
+    GeneratorOptions options;
+    if (!parseOptions(argc, argv, options))
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    std::ios::sync_with_stdio(false);
+
+    TermGenerator generator(options);
+    std::cout << options.lines << "\n";
+    for (long i = 0; i < options.lines; i++)
+        std::cout << generator.term() << "\n";
+
+    return 0;
+}
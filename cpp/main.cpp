@@ -1,436 +1,889 @@
+#include "cykparser.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
-#include <regex>
 #include <string>
 #include <vector>
-#include <set>
-#include <tuple>
-#include <map>
+#include <memory>
 using namespace std;
 
-using cyk_table = vector<vector<vector<string>>>;
-using cyk_result = std::tuple<cyk_table, bool>;
-using grammar_type = std::map<string, vector<vector<string>>>;
-
-// Non-terminals symbols
-vector<string> terminals = {"C", "D", "G",
-                            "variable"};
-vector<string> non_terminals = {"S", "A", "B", "E",
-                                "F", "H"};
-
-// Rules of the grammar
-grammar_type grammar = {
-    {"S", {{"A", "B"}, {"E", "F"}, {"(?!lambda)[a-zA-Z]+(-[a-zA-Z]+)*"}}},
-    {"A", {{"C", "S"}}},
-    {"B", {{"S", "D"}}},
-    {"C", {{"("}}},
-    {"D", {{")"}}},
-    {"E", {{"C", "G"}}},
-    {"F", {{"H", "B"}}},
-    {"G", {{"lambda"}}},
-    {"H", {{"A", "D"}}}};
-
-std::vector<std::string> splitInputString(const std::string &inputStr)
+// Buffered writer for the output. Text is handed to the stream in large
+// blocks rather than flushed after every case
+class OutputBuffer
 {
-    std::regex regexPattern("[\\(\\)]|lambda|[a-zA-Z]+(?:-[a-zA-Z]+)?");
-    std::vector<std::string> splitStrings;
+public:
+    explicit OutputBuffer(std::ostream &out, std::size_t capacity = 1 << 16)
+        : out(out), capacity(capacity)
+    {
+        buffer.reserve(capacity);
+    }
+
+    ~OutputBuffer()
+    {
+        flush();
+    }
+
+    void write(const char *text, std::size_t size)
+    {
+        if (buffer.size() + size > capacity)
+            drain();
+        buffer.append(text, size);
+    }
+
+    void write(const std::string &text)
+    {
+        write(text.data(), text.size());
+    }
+
+    void flush()
+    {
+        drain();
+        out.flush();
+    }
 
-    std::sregex_iterator iter(inputStr.begin(), inputStr.end(), regexPattern);
-    std::sregex_iterator end;
+private:
+    void drain()
+    {
+        out.write(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+
+    std::ostream &out;
+    std::size_t capacity;
+    std::string buffer;
+};
 
-    for (; iter != end; ++iter)
+void writeCase(OutputBuffer &out, long long case_number, const CaseResult &result)
+{
+    if (!result.accepted)
+        return;
+
+    out.write("Case #" + std::to_string(case_number) + ":");
+    for (const string &variable : result.free_variables)
     {
-        splitStrings.push_back(iter->str());
+        out.write(" ", 1);
+        out.write(variable);
     }
+    out.write("\n", 1);
 
-    return splitStrings;
+    if (result.derivations > 0)
+    {
+        out.write("Derivations: ");
+        if (result.derivations == saturated_count)
+            out.write("at least ");
+        out.write(std::to_string(result.derivations) + "\n");
+    }
+    for (std::size_t tree = 0; tree < result.trees.size(); tree++)
+        out.write("Tree #" + std::to_string(tree + 1) + ": " + result.trees[tree] + "\n");
 }
 
-bool isTerminal(const std::vector<std::string> &rule_right_side)
+// Tells why a case was rejected, with the column where it went wrong when
+// the LineValidator rejected it
+void explainReject(std::ostream &out, long long case_number, const CaseResult &result)
 {
-    return rule_right_side.size() == 1;
+    out << "Case #" << case_number << ": rejected";
+    if (result.reject_reason != RejectReason::NONE && result.reject_reason != RejectReason::OUT_OF_MEMORY)
+        out << " at column " << result.reject_position + 1;
+    out << ": " << rejectReasonText(result.reject_reason) << "\n";
 }
 
-bool isTerminalAndEqualToToken(const std::vector<std::string> &rule_right_side, const std::string &token)
+// Per-line latencies of one stage of the pipeline
+struct StageTimings
 {
-    bool match = false;
-    if (isTerminal(rule_right_side))
+    std::string name;
+    std::vector<double> nanoseconds;
+    long long tokens;
+
+    explicit StageTimings(const std::string &name) : name(name), tokens(0) {}
+
+    void add(std::chrono::steady_clock::time_point start, std::size_t line_tokens)
     {
-        try
-        {
-            std::regex regexPattern(rule_right_side[0]);
-            match = std::regex_match(token, regexPattern);
-        }
-        catch (...)
-        {
-            match = rule_right_side[0] == token;
-        }
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        nanoseconds.push_back(elapsed.count());
+        tokens += (long long)line_tokens;
     }
-    return match;
+};
+
+// Nearest-rank percentile of sorted samples
+double percentile(const std::vector<double> &sorted, double fraction)
+{
+    if (sorted.empty())
+        return 0;
+    std::size_t rank = (std::size_t)std::ceil(fraction * sorted.size());
+    return sorted[std::min(sorted.size(), std::max<std::size_t>(rank, 1)) - 1];
+}
+
+void writeStageJson(std::ostream &out, StageTimings &stage)
+{
+    std::sort(stage.nanoseconds.begin(), stage.nanoseconds.end());
+    double seconds = 0;
+    for (double sample : stage.nanoseconds)
+        seconds += sample / 1e9;
+    double lines = (double)stage.nanoseconds.size();
+
+    out << "{\"stage\":\"" << stage.name << "\""
+        << ",\"lines\":" << stage.nanoseconds.size()
+        << ",\"tokens\":" << stage.tokens
+        << ",\"seconds\":" << seconds
+        << ",\"lines_per_second\":" << (seconds > 0 ? lines / seconds : 0)
+        << ",\"tokens_per_second\":" << (seconds > 0 ? stage.tokens / seconds : 0)
+        << ",\"latency_ns\":{\"p50\":" << percentile(stage.nanoseconds, 0.50)
+        << ",\"p90\":" << percentile(stage.nanoseconds, 0.90)
+        << ",\"p99\":" << percentile(stage.nanoseconds, 0.99)
+        << ",\"max\":" << (stage.nanoseconds.empty() ? 0 : stage.nanoseconds.back()) << "}}";
 }
 
-void printStringVector(vector<string> str)
+const char *engineName(ParseEngine engine)
 {
-    std::cout << "Input string "
-              << "\033[94m";
-    for (const auto &str : str)
+    switch (engine)
     {
-        std::cout << str << " ";
+    case ParseEngine::CYK:
+        return "cyk";
+    case ParseEngine::MATRIX:
+        return "matrix";
+    default:
+        return "ll";
     }
-    std::cout << "\033[0m is ";
 }
 
-// function to perform the CYK Algorithm
-cyk_result cykParse(vector<string> input_str)
+// Runs every line of the input through the pipeline on one thread,
+// timing each stage on its own, and writes one JSON object with the
+// throughput and latency percentiles of every stage
+void runBenchmark(const CompiledGrammar &grammar, std::istream &input, const EvaluationOptions &options,
+                  std::ostream &out)
 {
-    int input_str_size = (int)input_str.size();
+    long long quantity = 0;
+    input >> quantity;
+    input.ignore();
 
-    // Initialize the table
-    cyk_table solution_table(input_str_size + 1, std::vector<std::vector<std::string>>(input_str_size + 1));
+    std::vector<std::string> lines;
+    std::string input_line;
+    for (long long i = 0; i < quantity; i++)
+    {
+        std::getline(input, input_line);
+        lines.push_back(input_line);
+    }
 
-    // Filling in the table
-    for (int j = 0; j < input_str_size; j++)
+    std::vector<Token> tokens;
+    cyk_table table;
+    ChartScratch scratch;
+    NodeArena arena;
+    FreeVariableCollector collector;
+    std::vector<DerivationStep> steps;
+    std::vector<int> nodes;
+    PredictiveParser predictive(grammar);
+    std::vector<std::string> variables;
+    StageTimings tokenize_stage("tokenize");
+    StageTimings parse_stage(std::string(engineName(options.engine)) + "_parse");
+    StageTimings tree_stage("build_tree");
+    StageTimings variables_stage("free_variables");
+    long long accepted = 0;
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    for (const std::string &line : lines)
     {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        tokenize(line, tokens);
+        tokenize_stage.add(start, tokens.size());
 
-        // Iterate over the rules
-        for (auto rules : grammar)
+        int root = no_node;
+        if (options.engine != ParseEngine::LL)
         {
-            string rule_left_side = rules.first;
-            vector<vector<string>> rule_right_side = rules.second;
-
-            for (auto rule : rule_right_side)
+            start = std::chrono::steady_clock::now();
+            bool line_accepted;
+            try
             {
-
-                // If a terminal is found
-                if (isTerminalAndEqualToToken(rule, input_str[j]))
-                    solution_table[j][j].push_back(rule_left_side);
+                line_accepted = fillChart(grammar, options.engine, options.chart, line, tokens, table, scratch);
             }
-        }
-
-        for (int i = j; i >= 0; i--)
-        {
-
-            // Iterate over the range from i to j
-            for (int k = i; k <= j; k++)
+            catch (const std::bad_alloc &)
             {
+                // Too long for a chart, so counted as rejected
+                line_accepted = false;
+            }
+            parse_stage.add(start, tokens.size());
+            if (!line_accepted)
+                continue;
 
-                // Iterate over the rules
-                for (auto rules : grammar)
-                {
-                    string rule_left_side = rules.first;
-                    vector<vector<string>> rule_right_side = rules.second;
-
-                    for (std::vector<std::string> rule : rule_right_side)
-                    {
-                        // If a terminal is found
-                        if (rule.size() == 2)
-                        {
-                            string left_symbol_rule = rule[0];
-                            string right_symbol_rule = rule[1];
-                            // Now searches for matches in table
-                            for (string left_symbol : solution_table[i][k])
-                            {
-                                for (string right_symbol : solution_table[k + 1][j])
-                                {
-                                    if ((left_symbol_rule == left_symbol) && (right_symbol_rule == right_symbol))
-                                    {
-                                        solution_table[i][j].push_back(rule_left_side);
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
+            if (options.free_variables_only)
+            {
+                start = std::chrono::steady_clock::now();
+                collectFreeVariables(grammar, table, line, tokens, collector, steps, variables);
+                variables_stage.add(start, tokens.size());
+                accepted++;
+                continue;
             }
-        }
-    }
 
-    // If word can be formed by rules
-    // of given grammar
-    // printStringVector(input_str);
-    if (solution_table[0][input_str_size - 1].size() != 0)
-    {
-        // std::cout
-        //     << "\033[1;32mAccepted!\033[0m"
-        //     << std::endl;
+            start = std::chrono::steady_clock::now();
+            root = buildTree(grammar, table, tokens, arena);
+            tree_stage.add(start, tokens.size());
+        }
+        else
+        {
+            start = std::chrono::steady_clock::now();
+            root = predictive.parse(tokens, arena);
+            parse_stage.add(start, tokens.size());
+            if (root == no_node)
+                continue;
+        }
 
-        return std::make_tuple(solution_table, true);
+        start = std::chrono::steady_clock::now();
+        ParseTree tree = {arena, line, tokens, binderSymbol(grammar)};
+        collectFreeVariables(tree, root, collector, nodes, variables);
+        variables_stage.add(start, tokens.size());
+        accepted++;
     }
-    else
+    std::chrono::duration<double> total = std::chrono::steady_clock::now() - begin;
+
+    out << "{\"engine\":\"" << engineName(options.engine) << "\""
+        << ",\"kernel\":\"" << splitKernelName(options.chart.kernel) << "\""
+        << ",\"chart_threads\":" << (options.chart.pool ? options.chart.pool->size() : 1)
+        << ",\"free_variables_only\":" << (options.free_variables_only ? "true" : "false")
+        << ",\"lines\":" << lines.size()
+        << ",\"accepted\":" << accepted
+        << ",\"tokens\":" << tokenize_stage.tokens
+        << ",\"seconds\":" << total.count()
+        << ",\"lines_per_second\":" << (total.count() > 0 ? lines.size() / total.count() : 0)
+        << ",\"stages\":[";
+    StageTimings *stages[] = {&tokenize_stage, &parse_stage, &tree_stage, &variables_stage};
+    bool first = true;
+    for (StageTimings *stage : stages)
     {
-        // std::cout << "\033[1;31mRejected!\033[0m"
-        //           << std::endl;
-        return std::make_tuple(solution_table, false);
+        if (stage->nanoseconds.empty())
+            continue;
+        if (!first)
+            out << ",";
+        writeStageJson(out, *stage);
+        first = false;
     }
+    out << "]}" << std::endl;
 }
 
-// C++ version of the Node class
-class Node
+void writeStatsText(std::ostream &out, const ParseStats &stats)
 {
-public:
-    std::string value;
-    std::string terminal_value;
-    Node *left;
-    Node *right;
-    std::vector<std::string> possible_symbols;
+    out << "lines=" << stats.lines << " accepted=" << stats.accepted << " tokens=" << stats.tokens
+        << " chart_cells=" << stats.chart_cells << " rule_applications=" << stats.rule_applications
+        << " chart_entries=" << stats.chart_entries << " tree_nodes=" << stats.tree_nodes
+        << " forest_nodes=" << stats.forest_nodes << " cache_hits=" << stats.cache_hits
+        << " cache_misses=" << stats.cache_misses << " early_rejects=" << stats.early_rejects;
+    for (int stage = 0; stage < STAGE_COUNT; stage++)
+        out << " " << stage_names[stage] << "_us=" << stats.stage_seconds[stage] * 1e6;
+}
 
-    Node(const std::string &value, const std::string &terminal_value = "")
-        : value(value), terminal_value(terminal_value), left(nullptr), right(nullptr)
-    {
-        getPossibleSymbols(value);
-    }
+void writeStatsJson(std::ostream &out, const ParseStats &stats)
+{
+    out << "\"lines\":" << stats.lines << ",\"accepted\":" << stats.accepted << ",\"tokens\":" << stats.tokens
+        << ",\"chart_cells\":" << stats.chart_cells << ",\"rule_applications\":" << stats.rule_applications
+        << ",\"chart_entries\":" << stats.chart_entries << ",\"tree_nodes\":" << stats.tree_nodes
+        << ",\"forest_nodes\":" << stats.forest_nodes << ",\"cache_hits\":" << stats.cache_hits
+        << ",\"cache_misses\":" << stats.cache_misses << ",\"early_rejects\":" << stats.early_rejects
+        << ",\"stage_seconds\":{";
+    for (int stage = 0; stage < STAGE_COUNT; stage++)
+        out << (stage ? "," : "") << "\"" << stage_names[stage] << "\":" << stats.stage_seconds[stage];
+    out << "}";
+}
 
-    void addLeft(Node *node)
+// Destination of the --stats output: text on the standard error, or JSON
+// lines in a file
+class StatsReport
+{
+public:
+    bool open(const std::string &json_path)
     {
-        left = node;
+        if (json_path.empty())
+            return true;
+        json_file.open(json_path);
+        return (bool)json_file;
     }
 
-    void addRight(Node *node)
+    void writeCase(long long case_number, const ParseStats &stats)
     {
-        right = node;
+        if (json_file.is_open())
+        {
+            json_file << "{\"case\":" << case_number << ",";
+            writeStatsJson(json_file, stats);
+            json_file << "}\n";
+        }
+        else
+        {
+            std::cerr << "stats case " << case_number << ": ";
+            writeStatsText(std::cerr, stats);
+            std::cerr << "\n";
+        }
     }
 
-private:
-    void getPossibleSymbols(const std::string &symbol)
+    void writeSummary(const ParseStats &stats, int threads, double wall_seconds)
     {
-
-        auto it = grammar.find(symbol);
-        if (it != grammar.end())
+        if (json_file.is_open())
         {
-            const std::vector<std::vector<std::string>> &symbolRules = it->second;
-
-            for (const std::vector<std::string> &rule : symbolRules)
-            {
-                if (!rule.empty())
-                {
-                    for (const std::string &ruleSymbol : rule)
-                    {
-                        possible_symbols.push_back(ruleSymbol);
-                    }
-                }
-            }
+            json_file << "{\"summary\":true,\"threads\":" << threads << ",\"wall_seconds\":" << wall_seconds << ",";
+            writeStatsJson(json_file, stats);
+            json_file << "}" << std::endl;
+        }
+        else
+        {
+            std::cerr << "stats total: threads=" << threads << " wall_seconds=" << wall_seconds << " ";
+            writeStatsText(std::cerr, stats);
+            std::cerr << std::endl;
         }
     }
+
+private:
+    std::ofstream json_file;
 };
 
-// C++ version of the search_left function
-std::tuple<std::string, int> searchLeft(
-    int initialXIndex, const std::vector<std::vector<std::string>> &line, const std::vector<std::string> &possibleSymbols)
+// Splits a memory-mapped file into lines at each '\n', looking for the
+// newlines of separate chunks of the file in parallel. The lines point
+// into the mapping, and a last line without a newline is kept
+void splitLines(const char *data, std::size_t size, WorkerPool &pool, std::vector<TextView> &lines)
 {
-    for (int xIndex = initialXIndex - 1; xIndex >= 0; --xIndex)
+    lines.clear();
+    // An empty file has no mapping to scan
+    if (size == 0)
+        return;
+
+    std::size_t chunk_count = std::min<std::size_t>(size / (1 << 16) + 1, (std::size_t)pool.size() * 8);
+    std::size_t chunk_size = size / chunk_count + 1;
+    std::vector<std::vector<std::size_t>> newlines(chunk_count);
+    pool.parallelFor(chunk_count, 1, [&](std::size_t chunk, int) {
+        const char *end = data + std::min(size, (chunk + 1) * chunk_size);
+        for (const char *next = data + std::min(size, chunk * chunk_size);
+             (next = (const char *)std::memchr(next, '\n', end - next)) != nullptr; next++)
+            newlines[chunk].push_back(next - data);
+    });
+
+    std::size_t start = 0;
+    for (const std::vector<std::size_t> &chunk : newlines)
     {
-        if (!line[xIndex].empty() && (std::find(possibleSymbols.begin(), possibleSymbols.end(), line[xIndex][0]) != possibleSymbols.end()))
+        for (std::size_t newline : chunk)
         {
-            return std::make_tuple(line[xIndex][0], xIndex);
+            lines.push_back(TextView(data + start, newline - start));
+            start = newline + 1;
         }
     }
-    return std::make_tuple("", -1);
+    if (start < size)
+        lines.push_back(TextView(data + start, size - start));
 }
 
-std::tuple<std::string, int> searchRight(
-    int initialYIndex, const std::vector<std::vector<std::string>> &line, const std::vector<std::string> &possibleSymbols)
+// Whether a line holds only a case count, as the first line of the input
+// format does
+bool isCountLine(TextView line, long long &count)
 {
-    for (std::size_t yIndex = initialYIndex + 1; yIndex < line.size(); ++yIndex)
+    std::string text = line.str();
+    std::size_t first = text.find_first_not_of(" \t\r");
+    std::size_t last = text.find_last_not_of(" \t\r");
+    if (first == std::string::npos)
+        return false;
+    for (std::size_t i = first; i <= last; i++)
     {
-        if (!line[yIndex].empty() && (std::find(possibleSymbols.begin(), possibleSymbols.end(), line[yIndex][0]) != possibleSymbols.end()))
-        {
-            return std::make_tuple(line[yIndex][0], static_cast<int>(yIndex));
-        }
+        if (text[i] < '0' || text[i] > '9')
+            return false;
     }
-    return std::make_tuple("", -1);
+    count = std::atoll(text.c_str() + first);
+    return true;
 }
 
-// C++ version of the search_nodes function
-std::tuple<std::string, std::vector<int>, std::string, std::vector<int>> searchNodes(
-    const cyk_table &table,
-    int xIndex,
-    int yIndex,
-    const std::vector<std::string> &possibleSymbols)
+// Cases of one mapped input file. A leading count line is optional: when
+// there is one, the file holds that many cases, and the missing ones are
+// filled in the way the stream input reads past the end of the file:
+// missing is set to their number and filler to the line they repeat. They
+// are not stored, since the count may be far larger than the file
+void fileCases(const MappedFile &file, WorkerPool &pool, std::vector<TextView> &cases, long long &missing,
+               TextView &filler)
 {
-    const std::vector<std::vector<std::string>> &xLine = table[yIndex];
-
-    std::string leftValue;
-    int leftIndex;
-    std::tie(leftValue, leftIndex) = searchLeft(xIndex, xLine, possibleSymbols);
-    std::vector<int> leftPoint = {leftIndex, yIndex};
-
-    std::string rightValue;
-    int rightIndex;
+    missing = 0;
+    splitLines(file.data, file.size, pool, cases);
 
-    std::vector<std::vector<std::string>> yLine;
+    long long count;
+    if (cases.empty() || !isCountLine(cases[0], count))
+        return;
 
-    for (const auto &line : table)
+    cases.erase(cases.begin());
+    if ((long long)cases.size() >= count)
     {
-        yLine.push_back(line[xIndex]);
+        cases.resize((std::size_t)count);
+        return;
     }
 
-    std::tie(rightValue, rightIndex) = searchRight(yIndex, yLine, possibleSymbols);
-    std::vector<int> rightPoint = {xIndex, rightIndex};
-
-    return std::make_tuple(leftValue, leftPoint, rightValue, rightPoint);
+    // getline repeats a last line that has no newline, and reads empty
+    // lines after a newline at the end of the file
+    bool repeat_last = !cases.empty() && file.data[file.size - 1] != '\n';
+    filler = repeat_last ? cases.back() : TextView();
+    missing = count - (long long)cases.size();
 }
 
-// C++ version of the build_tree function
-Node *buildTree(const cyk_table &table, const std::vector<std::string> &inputSplitted)
+// Command line options
+struct Options
 {
-    int inputLength = inputSplitted.size();
-    Node *initialNode = new Node(table[0][inputLength - 1][0]);
-
-    std::vector<int> initialPoint = {inputLength - 1, 0};
-    if (initialPoint[0] == initialPoint[1])
-    {
-        initialNode->terminal_value = inputSplitted[0];
-        return initialNode;
-    }
+    // Worker threads for the batch, 0 for one per hardware thread
+    int threads;
+    // Threads filling the chart of one long input with the chart engines,
+    // 0 for one per hardware thread
+    int chart_threads;
+    // Lines read ahead and evaluated together
+    std::size_t block_lines;
+    // Input file, the standard input when empty
+    std::string input_path;
+    // Files given as arguments, memory-mapped and read one after the other
+    // instead of the input stream
+    std::vector<std::string> input_files;
+    // Grammar to parse with instead of the built-in one, and where to
+    // write its compiled form
+    std::string grammar_path;
+    std::string save_grammar_path;
+    // Binary file of the ASTs of the accepted cases, none when empty
+    std::string ast_out_path;
+    EvaluationOptions evaluation;
+    bool engine_given;
+    // Check every chart against cyk with the scalar kernel
+    bool verify;
+    // Print why each rejected case was rejected to the standard error
+    bool explain_rejects;
+    // Memory budget of the result cache in MiB, 0 to disable it
+    double cache_mb;
+    // Time each stage instead of printing the cases
+    bool benchmark;
+    // Collect ParseStats, also for every case with stats_per_case, and
+    // write them to the standard error or to stats_json_path
+    bool stats;
+    bool stats_per_case;
+    std::string stats_json_path;
+};
 
-    std::vector<std::pair<Node *, std::vector<int>>> queue = {std::make_pair(initialNode, initialPoint)};
+void printUsage(const char *program)
+{
+    std::cerr << "Usage: " << program << " [options] < input" << std::endl
+              << "       " << program << " [options] FILE..." << std::endl
+              << "Files given as arguments are memory-mapped; their leading case count is optional" << std::endl
+              << "  --threads N        parse lines on N threads (0: one per core, default 1)" << std::endl
+              << "  --chart-threads N  fill the chart of a long input on N threads (0: one per core, default)" << std::endl
+              << "  --chart-threshold N  fill charts in parallel from N tokens on (default 2048)" << std::endl
+              << "  --backpointer-mb N keep chart backpointers while they take at most N MiB (default 64)" << std::endl
+              << "  --block N          read at most N lines ahead of the output (default 1024)" << std::endl
+              << "  --input FILE       read the input from FILE instead of the standard input" << std::endl
+              << "  --grammar FILE     parse with the CNF grammar of a JFLAP .jff file or of a compiled grammar" << std::endl
+              << "  --save-grammar FILE  write the compiled grammar to FILE and exit" << std::endl
+              << "  --engine NAME      parsing engine: ll (linear-time, default), cyk or matrix (bit-packed cyk)" << std::endl
+              << "  --kernel NAME      split point kernel of cyk: auto (default), avx2, sse2 or scalar" << std::endl
+              << "  --verify           with cyk or matrix, check every chart against cyk with the scalar kernel" << std::endl
+              << "  --free-vars-only   with cyk or matrix, compute free variables from the chart without building trees" << std::endl
+              << "  --count-derivations  print the number of derivations of each accepted line (uses cyk)" << std::endl
+              << "  --enumerate K      print the first K derivation trees of each accepted line (uses cyk)" << std::endl
+              << "  --ast-out FILE     write the AST of every accepted case to FILE in the flat binary format" << std::endl
+              << "  --strict           reject lines with characters that are not part of any token" << std::endl
+              << "  --explain-rejects  print why each rejected line was rejected to the standard error" << std::endl
+              << "  --cache-mb N       reuse the results of repeated lines, in at most N MiB (default 0: off)" << std::endl
+              << "  --bench            time each stage on one thread and print the results as JSON" << std::endl
+              << "  --stats            print stage timings and parser counters to the standard error" << std::endl
+              << "  --stats-per-case   with --stats, also print them for every case" << std::endl
+              << "  --stats-json FILE  with --stats, write them to FILE as JSON lines instead" << std::endl;
+}
 
-    while (!queue.empty())
+bool parseOptions(int argc, char *argv[], Options &options)
+{
+    options.threads = 1;
+    options.chart_threads = 0;
+    options.block_lines = 1024;
+    options.evaluation.engine = ParseEngine::LL;
+    options.engine_given = false;
+    options.verify = false;
+    options.explain_rejects = false;
+    options.evaluation.free_variables_only = false;
+    options.evaluation.cache = nullptr;
+    options.cache_mb = 0;
+    options.benchmark = false;
+    options.stats = false;
+    options.stats_per_case = false;
+
+    for (int i = 1; i < argc; i++)
     {
-        Node *node = queue.front().first;
-        std::vector<int> point = queue.front().second;
-        queue.erase(queue.begin());
-
-        int xIndex = point[0];
-        int yIndex = point[1];
-        std::string leftSymbol;
-        std::vector<int> leftPoint;
-        std::string rightSymbol;
-        std::vector<int> rightPoint;
-        std::tie(leftSymbol, leftPoint, rightSymbol, rightPoint) = searchNodes(table, xIndex, yIndex, node->possible_symbols);
-
-        Node *leftNode;
-        if (leftPoint[0] == leftPoint[1] && leftSymbol == "S")
+        std::string arg = argv[i];
+        if ((arg == "--threads" || arg == "-j") && i + 1 < argc)
         {
-            leftNode = new Node(leftSymbol, inputSplitted[leftPoint[0]]);
+            options.threads = std::atoi(argv[++i]);
         }
-        else
+        else if (arg == "--chart-threads" && i + 1 < argc)
         {
-            leftNode = new Node(leftSymbol);
+            options.chart_threads = std::atoi(argv[++i]);
         }
-
-        Node *rightNode;
-        if (rightPoint[0] == rightPoint[1] && rightSymbol == "S")
+        else if (arg == "--chart-threshold" && i + 1 < argc)
         {
-            rightNode = new Node(rightSymbol, inputSplitted[rightPoint[0]]);
+            options.evaluation.chart.parallel_threshold = std::atoi(argv[++i]);
         }
-        else
+        else if (arg == "--backpointer-mb" && i + 1 < argc)
         {
-            rightNode = new Node(rightSymbol);
+            double megabytes = std::atof(argv[++i]);
+            if (megabytes < 0)
+                return false;
+            options.evaluation.chart.backpointer_budget = (std::size_t)(megabytes * 1024 * 1024);
         }
-
-        node->addLeft(leftNode);
-        node->addRight(rightNode);
-
-        if (leftPoint[0] != leftPoint[1])
+        else if (arg == "--block" && i + 1 < argc)
         {
-            queue.push_back(std::make_pair(leftNode, leftPoint));
+            long block_lines = std::atol(argv[++i]);
+            if (block_lines <= 0)
+                return false;
+            options.block_lines = (std::size_t)block_lines;
         }
-
-        if (rightPoint[0] != rightPoint[1])
+        else if ((arg == "--input" || arg == "-i") && i + 1 < argc)
+        {
+            options.input_path = argv[++i];
+        }
+        else if (arg == "--engine" && i + 1 < argc)
         {
-            queue.push_back(std::make_pair(rightNode, rightPoint));
+            std::string engine = argv[++i];
+            if (engine == "ll")
+                options.evaluation.engine = ParseEngine::LL;
+            else if (engine == "cyk")
+                options.evaluation.engine = ParseEngine::CYK;
+            else if (engine == "matrix")
+                options.evaluation.engine = ParseEngine::MATRIX;
+            else
+                return false;
+            options.engine_given = true;
+        }
+        else if (arg == "--grammar" && i + 1 < argc)
+        {
+            options.grammar_path = argv[++i];
+        }
+        else if (arg == "--save-grammar" && i + 1 < argc)
+        {
+            options.save_grammar_path = argv[++i];
+        }
+        else if (arg == "--kernel" && i + 1 < argc)
+        {
+            std::string kernel = argv[++i];
+            if (!findSplitKernel(kernel, options.evaluation.chart.kernel))
+            {
+                std::cerr << "Unknown kernel or not supported on this CPU: " << kernel << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--verify")
+        {
+            options.verify = true;
+        }
+        else if (arg == "--free-vars-only")
+        {
+            options.evaluation.free_variables_only = true;
+        }
+        else if (arg == "--count-derivations")
+        {
+            options.evaluation.count_derivations = true;
+        }
+        else if (arg == "--enumerate" && i + 1 < argc)
+        {
+            options.evaluation.enumerate_trees = std::atoi(argv[++i]);
+            if (options.evaluation.enumerate_trees < 0)
+                return false;
+        }
+        else if (arg == "--ast-out" && i + 1 < argc)
+        {
+            options.ast_out_path = argv[++i];
+            options.evaluation.build_ast = true;
+        }
+        else if (arg == "--strict")
+        {
+            options.evaluation.strict = true;
+        }
+        else if (arg == "--explain-rejects")
+        {
+            options.explain_rejects = true;
+        }
+        else if (arg == "--cache-mb" && i + 1 < argc)
+        {
+            options.cache_mb = std::atof(argv[++i]);
+            if (options.cache_mb < 0)
+                return false;
+        }
+        else if (arg == "--bench")
+        {
+            options.benchmark = true;
+        }
+        else if (arg == "--stats")
+        {
+            options.stats = true;
+        }
+        else if (arg == "--stats-per-case")
+        {
+            options.stats = true;
+            options.stats_per_case = true;
+        }
+        else if (arg == "--stats-json" && i + 1 < argc)
+        {
+            options.stats = true;
+            options.stats_json_path = argv[++i];
+        }
+        else if (!arg.empty() && arg[0] != '-')
+        {
+            options.input_files.push_back(arg);
+        }
+        else
+        {
+            return false;
         }
     }
-
-    return initialNode;
+    return true;
 }
 
-std::vector<std::string> breadthSearchForVariables(Node *root);
-
-std::vector<std::string> getIndependentVariables(
-    const std::vector<std::string> &lambdaVariables, const std::vector<std::string> &possibleIndependentVariables)
+int main(int argc, char *argv[])
 {
-    std::vector<std::string> independentVariables;
-    for (const std::string &variable : possibleIndependentVariables)
+    Options options;
+    if (!parseOptions(argc, argv, options))
     {
-        if (std::find(lambdaVariables.begin(), lambdaVariables.end(), variable) == lambdaVariables.end())
-        {
-            independentVariables.push_back(variable);
-        }
+        printUsage(argv[0]);
+        return 1;
     }
-    return independentVariables;
-}
 
-std::vector<std::string> breadthSearchConsideringLambdaVariables(Node *root)
-{
-    std::vector<std::string> variables;
+    CompiledGrammar grammar = builtinCompiledGrammar();
 
-    if (root == nullptr)
-        return variables;
+#ifdef CYK_FIXED_GRAMMAR
+    if (!options.grammar_path.empty())
+    {
+        std::cerr << "Built with CYK_FIXED_GRAMMAR: only the built-in grammar can be used" << std::endl;
+        return 1;
+    }
+    if (!fixedGrammarMatches(grammar))
+    {
+        std::cerr << "The compile-time grammar tables do not match the built-in grammar" << std::endl;
+        return 1;
+    }
+#endif
 
-    std::vector<std::string> lambdaVariables = breadthSearchForVariables(root->left);
-    std::vector<std::string> possibleIndependentVariables = breadthSearchForVariables(root->right);
+    bool is_builtin = true;
+    if (!options.grammar_path.empty())
+    {
+        try
+        {
+            grammar = loadGrammar(options.grammar_path);
+        }
+        catch (const std::exception &error)
+        {
+            std::cerr << options.grammar_path << ": " << error.what() << std::endl;
+            return 1;
+        }
 
-    variables = getIndependentVariables(lambdaVariables, possibleIndependentVariables);
+        // The predictive parser and the AST only know the built-in grammar
+        is_builtin = isBuiltinGrammar(grammar);
+        if (options.evaluation.build_ast && !is_builtin)
+        {
+            std::cerr << "--ast-out only handles the built-in grammar" << std::endl;
+            return 1;
+        }
+        if (options.evaluation.engine == ParseEngine::LL && !is_builtin)
+        {
+            if (options.engine_given)
+                std::cerr << "The ll engine only parses the built-in grammar, using cyk" << std::endl;
+            options.evaluation.engine = ParseEngine::CYK;
+        }
+    }
 
-    return variables;
-}
+    // Derivations are counted and enumerated from the chart
+    if (options.evaluation.engine == ParseEngine::LL &&
+        (options.evaluation.count_derivations || options.evaluation.enumerate_trees > 0))
+    {
+        if (options.engine_given)
+            std::cerr << "The ll engine does not build a parse forest, using cyk" << std::endl;
+        options.evaluation.engine = ParseEngine::CYK;
+    }
 
-std::vector<std::string> breadthSearchForVariables(Node *root)
-{
-    std::vector<std::string> variables;
+    // Malformed lines are rejected in linear time before the chart engines
+    // see them. The ll engine rejects them as fast on its own, so it only
+    // needs the check to explain the rejects
+    options.evaluation.prevalidate =
+        is_builtin && (options.evaluation.engine != ParseEngine::LL || options.explain_rejects);
 
-    if (root == nullptr)
-        return variables;
+    if (!options.save_grammar_path.empty())
+    {
+        std::ofstream grammar_file(options.save_grammar_path, std::ios::binary);
+        grammar_file << serializeGrammar(grammar);
+        if (!grammar_file.flush())
+        {
+            std::cerr << "Cannot write " << options.save_grammar_path << std::endl;
+            return 1;
+        }
+        return 0;
+    }
 
-    if (root->value == "F")
+    int thread_count = options.threads;
+    if (thread_count <= 0)
+        thread_count = std::max(1, (int)std::thread::hardware_concurrency());
+    int chart_thread_count = options.chart_threads;
+    if (chart_thread_count <= 0)
+        chart_thread_count = std::max(1, (int)std::thread::hardware_concurrency());
+
+    // Only the chart engines fill charts, and the pool is shared by every
+    // batch worker
+    std::unique_ptr<WorkerPool> chart_workers;
+    if (options.evaluation.engine != ParseEngine::LL && chart_thread_count > 1)
     {
-        std::vector<std::string> independentVariables = breadthSearchConsideringLambdaVariables(root);
-        return independentVariables;
+        chart_workers.reset(new WorkerPool(chart_thread_count));
+        options.evaluation.chart.pool = chart_workers.get();
     }
 
-    std::vector<std::string> independentVariables = breadthSearchForVariables(root->left);
-    variables.insert(variables.end(), independentVariables.begin(), independentVariables.end());
+    std::atomic<long long> verify_failures(0);
+    if (options.verify)
+        options.evaluation.chart.verify_failures = &verify_failures;
 
-    independentVariables = breadthSearchForVariables(root->right);
-    variables.insert(variables.end(), independentVariables.begin(), independentVariables.end());
+    std::ios::sync_with_stdio(false);
 
-    if (!root->terminal_value.empty())
+    std::istream *input = &std::cin;
+    std::ifstream input_file;
+    if (!options.input_path.empty())
     {
-        variables.push_back(root->terminal_value);
+        input_file.open(options.input_path);
+        if (!input_file)
+        {
+            std::cerr << "Cannot open " << options.input_path << std::endl;
+            return 1;
+        }
+        input = &input_file;
     }
 
-    return variables;
-}
+    if (options.benchmark)
+    {
+        runBenchmark(grammar, *input, options.evaluation, std::cout);
+        return verify_failures > 0 ? 2 : 0;
+    }
 
-int main()
-{
-    int quantity;
-    std::cin >> quantity;
-    std::cin.ignore(); // Ignore the newline character after reading the quantity
+#ifdef CYK_NO_STATS
+    if (options.stats)
+        std::cerr << "Stats are not available: built with CYK_NO_STATS" << std::endl;
+    options.stats = false;
+#endif
+    StatsReport stats_report;
+    if (options.stats && !stats_report.open(options.stats_json_path))
+    {
+        std::cerr << "Cannot write " << options.stats_json_path << std::endl;
+        return 1;
+    }
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
 
-    std::vector<std::string> inputStrs;
-    inputStrs.reserve(quantity);
+    std::unique_ptr<ResultCache> cache;
+    if (options.cache_mb > 0)
+    {
+        cache.reset(new ResultCache((std::size_t)(options.cache_mb * 1024 * 1024)));
+        options.evaluation.cache = cache.get();
+    }
 
-    std::string input;
-    for (int i = 0; i < quantity; ++i)
+    AstWriter ast_writer;
+    if (options.evaluation.build_ast && !ast_writer.open(options.ast_out_path))
     {
-        std::getline(std::cin, input);
-        inputStrs.push_back(input);
+        std::cerr << "Cannot write " << options.ast_out_path << std::endl;
+        return 1;
     }
 
-    int _case = 1;
-    for (const std::string &inputStr : inputStrs)
+    WorkerPool pool(thread_count);
+    OutputBuffer out(std::cout);
+
+    // Lines are evaluated one block at a time. The buffers are reused
+    // across blocks
+    std::vector<Parser> parsers;
+    parsers.reserve(pool.size());
+    for (int i = 0; i < pool.size(); i++)
+        parsers.emplace_back(grammar, options.evaluation);
+    std::vector<CaseResult> results(options.block_lines);
+    std::vector<ParseStats> worker_stats(pool.size());
+    long long _case = 1;
+
+    // Lines are independent: evaluate them on the pool, then write the
+    // results in input order
+    auto evaluateBlock = [&](const TextView *lines, std::size_t count) {
+        pool.parallelFor(count, 32, [&](std::size_t index, int worker) {
+            parsers[worker].evaluate(lines[index], results[index], options.stats ? &worker_stats[worker] : nullptr,
+                                     options.stats_per_case);
+        });
+
+        for (std::size_t index = 0; index < count; index++)
+        {
+            writeCase(out, _case + (long long)index, results[index]);
+            if (options.explain_rejects && !results[index].accepted)
+                explainReject(std::cerr, _case + (long long)index, results[index]);
+            if (options.evaluation.build_ast)
+                ast_writer.add(_case + (long long)index, results[index].ast, results[index].ast_names);
+            if (options.stats_per_case)
+                stats_report.writeCase(_case + (long long)index, results[index].stats);
+        }
+        out.flush();
+
+        _case += (long long)count;
+    };
+
+    if (!options.input_files.empty())
     {
-        std::vector<std::string> splitStrings = splitInputString(inputStr);
-        // Function Call
-        cyk_result result = cykParse(splitStrings);
+        // Each file is mapped and split into lines that point into the
+        // mapping, and the case numbers go on from one file to the next
+        std::vector<TextView> cases;
+        std::vector<TextView> fillers;
+        for (const std::string &path : options.input_files)
+        {
+            MappedFile file;
+            if (!file.open(path))
+            {
+                std::cerr << "Cannot open " << path << std::endl;
+                return 1;
+            }
 
-        cyk_table table = std::get<0>(result);
-        bool accepted = std::get<1>(result);
-        if (accepted)
+            long long missing;
+            TextView filler;
+            fileCases(file, pool, cases, missing, filler);
+            for (std::size_t first = 0; first < cases.size(); first += options.block_lines)
+                evaluateBlock(&cases[first], std::min(options.block_lines, cases.size() - first));
+
+            fillers.assign(options.block_lines, filler);
+            for (; missing > 0; missing -= (long long)options.block_lines)
+                evaluateBlock(fillers.data(), (std::size_t)std::min<long long>(missing, options.block_lines));
+        }
+    }
+    else
+    {
+        long long quantity = 0;
+        *input >> quantity;
+        input->ignore(); // Ignore the newline character after reading the quantity
+
+        // Lines are read one block at a time, so memory stays bounded by
+        // the block size and results are written while the rest of the
+        // input is still arriving
+        std::vector<std::string> inputStrs(options.block_lines);
+        std::vector<TextView> lines(options.block_lines);
+        std::string input_line;
+        while (_case <= quantity)
         {
-            Node *start = buildTree(table, splitStrings);
-            vector<string> independent_variables = breadthSearchForVariables(start);
-            cout << "Case #" << _case << ":";
-            for (const string &variable : independent_variables)
+            std::size_t count = (std::size_t)std::min<long long>(options.block_lines, quantity - _case + 1);
+            for (std::size_t i = 0; i < count; ++i)
             {
-                cout << " " << variable;
+                // Past the end of the input, getline leaves the last line in place
+                std::getline(*input, input_line);
+                inputStrs[i].assign(input_line);
+                lines[i] = inputStrs[i];
             }
-            cout << endl;
+
+            evaluateBlock(lines.data(), count);
         }
-        _case++;
     }
 
+    if (options.evaluation.build_ast && !ast_writer.close())
+    {
+        std::cerr << "Cannot write " << options.ast_out_path << std::endl;
+        return 1;
+    }
+
+    if (options.stats)
+    {
+        ParseStats totals;
+        for (const ParseStats &stats : worker_stats)
+            totals.merge(stats);
+        std::chrono::duration<double> wall = std::chrono::steady_clock::now() - start_time;
+        stats_report.writeSummary(totals, pool.size(), wall.count());
+    }
+
+    if (verify_failures > 0)
+    {
+        std::cerr << "verify: " << verify_failures << " charts differ" << std::endl;
+        return 2;
+    }
     return 0;
-}
\ No newline at end of file
+}